@@ -4,8 +4,15 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <err.h>
 #include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <math.h>
+#include <pthread.h>
+#include <linux/perf_event.h>
 #include "os.h"
 
 /* 
@@ -17,23 +24,75 @@
 
 void test_suite_1(void);
 void test_suite_2(void);
+void test_suite_tlb(void);
+void test_suite_range(void);
+void test_suite_huge(void);
+void test_suite_reclaim(void);
+void test_suite_concurrent(void);
+void test_suite_walk_cache(void);
+void test_suite_batch(void);
+void test_suite_clone(void);
+void test_suite_for_each(void);
+void test_suite_geometry(void);
+void test_suite_backend(void);
+
+void bench_workloads(int use_perf);
+void bench_backend(void);
+void bench_tlb(void);
+void bench_range(void);
+void bench_huge(void);
+void bench_reclaim(void);
+void bench_concurrent(void);
+void bench_walk_cache(void);
+void bench_batch(void);
+void bench_clone(void);
+void bench_for_each(void);
+void bench_alloc(void);
 
 /* 2^20 pages ought to be enough for anybody */
 #define NPAGES	(1024*1024)
 
+/* Built against pt_hash.c, only the calls it implements (see os.h) exist */
+#ifdef PT_BACKEND_HASH
+#define BACKEND_NAME	"hash"
+#else
+#define BACKEND_NAME	"radix"
+#endif
+
+/* Most suites hardcode VPNs and node counts for 5 levels of 9 bits */
+#define DEFAULT_GEOMETRY	(PT_LEVELS == 5 && PT_BITS_PER_LEVEL == 9)
+
 // For test suite 1
-#define VPN_MASK 0x1FFFFFFFFFFF
+#define VPN_MASK ((1ULL << PT_VPN_BITS) - 1)
 #define PPN_MASK 0xFFFFFFFFFFFFF
 
 
+#define PPN_BASE 0xbaaaaaad
+
+/* 
+	~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~MMAP FRAME ALLOCATOR~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+	One mmap per frame, found again through the pages[] table.
+*/
+
 static char* pages[NPAGES];
+static uint64_t nalloc;
 
-uint64_t alloc_page_frame(void)
+/* Frames handed back through free_page_frame, reused before fresh ones */
+static uint64_t free_frames[NPAGES];
+static uint64_t nfree;
+
+uint64_t mmap_alloc_frame(void)
 {
-	static uint64_t nalloc;
 	uint64_t ppn;
 	void* va;
 
+	if (nfree > 0) {
+		/* Recycled frames are dirty, fresh mmap'd ones aren't */
+		ppn = free_frames[--nfree];
+		memset(pages[ppn], 0, 4096);
+		return ppn + PPN_BASE;
+	}
+
 	if (nalloc == NPAGES)
 		errx(1, "out of physical memory");
 
@@ -46,12 +105,20 @@ uint64_t alloc_page_frame(void)
 		err(1, "mmap failed");
 
 	pages[ppn] = va;
-	return ppn + 0xbaaaaaad;
+	return ppn + PPN_BASE;
 }
 
-void* phys_to_virt(uint64_t phys_addr)
+void mmap_free_frame(uint64_t ppn)
+{
+	ppn -= PPN_BASE;
+	if (ppn >= nalloc)
+		errx(1, "freeing a frame that was never allocated");
+	free_frames[nfree++] = ppn;
+}
+
+void* mmap_phys_to_virt(uint64_t phys_addr)
 {
-	uint64_t ppn = (phys_addr >> 12) - 0xbaaaaaad;
+	uint64_t ppn = (phys_addr >> 12) - PPN_BASE;
 	uint64_t off = phys_addr & 0xfff;
 	char* va = NULL;
 
@@ -61,10 +128,191 @@ void* phys_to_virt(uint64_t phys_addr)
 	return va;
 }
 
+uint64_t mmap_frames_in_use(void)
+{
+	return nalloc - nfree;
+}
+
+const struct frame_allocator mmap_frame_allocator = {
+	"mmap", mmap_alloc_frame, mmap_free_frame, mmap_phys_to_virt, mmap_frames_in_use
+};
+
+/* 
+	~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~ARENA FRAME ALLOCATOR~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+	Frames are carved out of one big reservation, so a frame's address is just
+	an offset into it. Freed frames are chained through their first word.
+*/
+
+static char* arena;
+static uint64_t arena_frames;
+static uint64_t arena_next;		/* Bump pointer: first never-used frame */
+static uint64_t arena_free = ~0ULL;	/* Head of the free list */
+static uint64_t arena_nfree;
+
+int arena_frame_allocator_init(uint64_t nframes, int flags)
+{
+	int mmap_flags = MAP_PRIVATE | MAP_ANONYMOUS;
+	void* va = MAP_FAILED;
+
+	if (flags & ARENA_POPULATE)
+		mmap_flags |= MAP_POPULATE;
+	/* Not MAP_NORESERVE: running out of huge pages would only show up as a
+	 * SIGBUS on first touch, rather than as a failed mmap here */
+	if (flags & ARENA_HUGETLB)
+		va = mmap(NULL, nframes * 4096, PROT_READ|PROT_WRITE, mmap_flags | MAP_HUGETLB, -1, 0);
+	/* Without reserved huge pages, settle for transparent ones */
+	if (va == MAP_FAILED) {
+		va = mmap(NULL, nframes * 4096, PROT_READ|PROT_WRITE, mmap_flags | MAP_NORESERVE, -1, 0);
+		if (va == MAP_FAILED)
+			return -1;
+		if (flags & ARENA_HUGETLB)
+			madvise(va, nframes * 4096, MADV_HUGEPAGE);
+	}
+
+	arena = va;
+	arena_frames = nframes;
+	return 0;
+}
+
+uint64_t arena_alloc_frame(void)
+{
+	uint64_t ppn;
+
+	if (arena_free != ~0ULL) {
+		ppn = arena_free;
+		arena_free = *(uint64_t*)(arena + ppn * 4096);
+		arena_nfree--;
+		memset(arena + ppn * 4096, 0, 4096);
+		return ppn + PPN_BASE;
+	}
+
+	if (arena_next == arena_frames)
+		errx(1, "out of physical memory");
+	return arena_next++ + PPN_BASE;
+}
+
+void arena_free_frame(uint64_t ppn)
+{
+	ppn -= PPN_BASE;
+	if (ppn >= arena_next)
+		errx(1, "freeing a frame that was never allocated");
+	*(uint64_t*)(arena + ppn * 4096) = arena_free;
+	arena_free = ppn;
+	arena_nfree++;
+}
+
+void* arena_phys_to_virt(uint64_t phys_addr)
+{
+	uint64_t ppn = (phys_addr >> 12) - PPN_BASE;
+
+	if (ppn >= arena_frames)
+		return NULL;
+	return arena + ppn * 4096 + (phys_addr & 0xfff);
+}
+
+uint64_t arena_frames_in_use(void)
+{
+	return arena_next - arena_nfree;
+}
+
+const struct frame_allocator arena_frame_allocator = {
+	"arena", arena_alloc_frame, arena_free_frame, arena_phys_to_virt, arena_frames_in_use
+};
+
+/* 
+	~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~OS INTERFACE~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+*/
+
+static const struct frame_allocator* allocator = &mmap_frame_allocator;
+
+void set_frame_allocator(const struct frame_allocator* frame_allocator)
+{
+	allocator = frame_allocator;
+}
+
+uint64_t alloc_page_frame(void)
+{
+	return allocator->alloc();
+}
+
+void free_page_frame(uint64_t ppn)
+{
+	allocator->free(ppn);
+}
+
+void* phys_to_virt(uint64_t phys_addr)
+{
+	return allocator->phys_to_virt(phys_addr);
+}
+
+/* Number of frames currently allocated */
+uint64_t frames_in_use(void)
+{
+	return allocator->in_use();
+}
+
+/* Usage: os [bench [perf]] [arena] */
 int main(int argc, char **argv) 
 {
+	int bench = 0;
+	int use_perf = 0;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "bench") == 0) {
+			bench = 1;
+		} else if (strcmp(argv[i], "perf") == 0) {
+			use_perf = 1;
+		} else if (strcmp(argv[i], "arena") == 0) {
+			if (arena_frame_allocator_init(NPAGES, ARENA_HUGETLB) != 0)
+				err(1, "arena reservation failed");
+			set_frame_allocator(&arena_frame_allocator);
+		}
+	}
+
+	if (bench) {
+		printf("frame allocator: %s, page table: %s\n", allocator->name, BACKEND_NAME);
+		bench_workloads(use_perf);
+		bench_backend();
+#ifndef PT_BACKEND_HASH
+		bench_tlb();
+#if DEFAULT_GEOMETRY
+		bench_range();
+		bench_huge();
+		bench_reclaim();
+#endif
+		bench_concurrent();
+		bench_walk_cache();
+		bench_batch();
+#if DEFAULT_GEOMETRY
+		bench_clone();
+		bench_for_each();
+#endif
+#endif
+		bench_alloc();
+		return 0;
+	}
+
 	test_suite_1();
+#if DEFAULT_GEOMETRY
 	test_suite_2();
+#endif
+#ifndef PT_BACKEND_HASH
+	test_suite_tlb();
+#if DEFAULT_GEOMETRY
+	test_suite_range();
+	test_suite_huge();
+	test_suite_reclaim();
+#endif
+	test_suite_concurrent();
+#if DEFAULT_GEOMETRY
+	test_suite_walk_cache();
+	test_suite_batch();
+	test_suite_clone();
+	test_suite_for_each();
+#endif
+	test_suite_geometry();
+#endif
+	test_suite_backend();
 	return 0;
 }
 
@@ -159,9 +407,9 @@ void update_random_and_check(uint64_t pt) {
 }
 
 void update_many_with_prefix(uint64_t pt) {
-	int prefix = (rand() % 45) + 1;
+	int prefix = (rand() % PT_VPN_BITS) + 1;
 	uint64_t mask = power(2, prefix + 1) - 1;
-	uint64_t vpn_mask = power(2, (45 - prefix) + 1) - 1;
+	uint64_t vpn_mask = power(2, (PT_VPN_BITS - prefix) + 1) - 1;
 	int amount = (rand() % 20) + 2;
 
 	if (amount > vpn_mask / 2)
@@ -173,7 +421,7 @@ void update_many_with_prefix(uint64_t pt) {
 
 	get_random_list(&vpn_arr, amount, vpn_mask);
 	for (int i = 0; i < amount; i++) {
-		vpn_arr[i] = block + vpn_arr[i];
+		vpn_arr[i] = (block + vpn_arr[i]) & VPN_MASK;
 		ppn_arr[i] = get_random_ppn();
 
 		page_table_update(pt, vpn_arr[i], ppn_arr[i]);	
@@ -244,7 +492,6 @@ void test_suite_2(void) {
 	printf("0th Test: PASSED\n");
 
 	uint64_t new_pt = alloc_page_frame();
-	uint64_t *tmp;
 
 	/* 1st Test */
 	assert(page_table_query(pt, 0xcafe) == NO_MAPPING);
@@ -291,7 +538,9 @@ void test_suite_2(void) {
 	assert(page_table_query(new_pt, 0xcafe) == NO_MAPPING);
 	printf("5th Test: PASSED\n");
 	
+#ifndef PT_BACKEND_HASH
 	/* 6th Test */
+	uint64_t *tmp;
 	page_table_update(pt, 0x1ffff8000000, 0x1212);
 	assert(page_table_query(pt, 0x1ffff8000000) == 0x1212);
 	tmp = phys_to_virt(pt << 12);
@@ -302,6 +551,1137 @@ void test_suite_2(void) {
 	tmp[0] = ((tmp[0] >> 1) << 1);
 	assert(page_table_query(pt, 0x1ffff8000000) == NO_MAPPING);
 	printf("6th Test: PASSED\n\n----------------\n");
+#endif
 	
 	printf("Overall:  PASSED SUITE 2\n\n");
 }
+
+/* Suites of features only the radix tree has */
+#ifndef PT_BACKEND_HASH
+void test_suite_tlb(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t hits, misses;
+
+	assert(page_table_tlb_enable(pt) == 0);
+
+	/* Remapping and unmapping must not leave stale translations behind */
+	page_table_update(pt, 0xcafe, 0xf00d);
+	assert(page_table_query(pt, 0xcafe) == 0xf00d);
+	assert(page_table_query(pt, 0xcafe) == 0xf00d);
+	page_table_update(pt, 0xcafe, 0xbeef);
+	assert(page_table_query(pt, 0xcafe) == 0xbeef);
+	page_table_update(pt, 0xcafe, NO_MAPPING);
+	assert(page_table_query(pt, 0xcafe) == NO_MAPPING);
+
+	/* VPNs sharing a set evict each other without mixing up translations */
+	for (uint64_t i = 0; i < 16; i++)
+		page_table_update(pt, 0x1000 + i * 64, 0x2000 + i);
+	for (int round = 0; round < 2; round++)
+		for (uint64_t i = 0; i < 16; i++)
+			assert(page_table_query(pt, 0x1000 + i * 64) == 0x2000 + i);
+
+	for (int i = 0; i < power(2, 13); i++)
+		perform_random_move(pt);
+
+	page_table_tlb_stats(pt, &hits, &misses);
+	assert(hits > 0 && misses > 0);
+	page_table_tlb_disable(pt);
+	printf("\n\nPASSED TLB SUITE\n\n");
+}
+
+void test_suite_range(void) {
+	uint64_t pt = alloc_page_frame();
+	/* Starts just below a leaf boundary and crosses several of them */
+	uint64_t start = 0x3fe00 - 5;
+	uint64_t count = 2000;
+
+	page_table_update_range(pt, start, 0x5000, count);
+	assert(page_table_query(pt, start - 1) == NO_MAPPING);
+	assert(page_table_query(pt, start + count) == NO_MAPPING);
+	for (uint64_t i = 0; i < count; i++)
+		assert(page_table_query(pt, start + i) == 0x5000 + i);
+
+	/* Punch a hole in the middle */
+	page_table_unmap_range(pt, start + 100, 600);
+	for (uint64_t i = 0; i < count; i++) {
+		uint64_t expected = (i >= 100 && i < 700) ? NO_MAPPING : 0x5000 + i;
+		assert(page_table_query(pt, start + i) == expected);
+	}
+
+	/* Unmapping across huge unmapped regions must skip, not walk, them */
+	page_table_update(pt, 0x1ffffffffff0, 0x77);
+	page_table_unmap_range(pt, 0, 0x1ffffffffff0);
+	assert(page_table_query(pt, start + 1000) == NO_MAPPING);
+	assert(page_table_query(pt, 0x1ffffffffff0) == 0x77);
+
+	/* The top of the address space */
+	page_table_update_range(pt, 0x1ffffffffff0, 0x100, 16);
+	assert(page_table_query(pt, 0x1fffffffffff) == 0x10f);
+	page_table_unmap_range(pt, 0x1ffffffffff0, 16);
+	assert(page_table_query(pt, 0x1ffffffffff0) == NO_MAPPING);
+	printf("PASSED RANGE SUITE\n\n");
+}
+
+/* Returns the raw PTE indexing vpn in the node at the given level */
+uint64_t raw_pte(uint64_t pt, uint64_t vpn, int level) {
+	uint64_t *node = phys_to_virt(pt << 12);
+
+	for (int i = 0; i < level; i++)
+		node = phys_to_virt((node[(vpn >> (9 * (4 - i))) & 0x1ff] >> 12) << 12);
+	return node[(vpn >> (9 * (4 - level))) & 0x1ff];
+}
+
+void test_suite_huge(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t vpn_2m = 0x2a00000 >> 3;	/* 512-aligned */
+	uint64_t vpn_1g = 0x40000 * 5;		/* 2^18-aligned */
+
+	assert(page_table_update_sized(pt, vpn_2m + 1, 0x200, PAGE_SIZE_2M) == -1);
+	assert(page_table_update_sized(pt, vpn_2m, 0x201, PAGE_SIZE_2M) == -1);
+
+	/* A 2 MiB page is a single PTE at level 3 */
+	assert(page_table_update_sized(pt, vpn_2m, 0x200, PAGE_SIZE_2M) == 0);
+	assert(raw_pte(pt, vpn_2m, 3) & 0x2);
+	assert(page_table_query(pt, vpn_2m) == 0x200);
+	assert(page_table_query(pt, vpn_2m + 511) == 0x200 + 511);
+	assert(page_table_query(pt, vpn_2m + 512) == NO_MAPPING);
+
+	/* Touching a single page inside it splits it */
+	page_table_update(pt, vpn_2m + 7, 0xcafe);
+	assert(!(raw_pte(pt, vpn_2m, 3) & 0x2));
+	assert(page_table_query(pt, vpn_2m + 7) == 0xcafe);
+	assert(page_table_query(pt, vpn_2m + 6) == 0x200 + 6);
+	page_table_unmap_range(pt, vpn_2m + 8, 4);
+	assert(page_table_query(pt, vpn_2m + 9) == NO_MAPPING);
+	assert(page_table_query(pt, vpn_2m + 12) == 0x200 + 12);
+	assert(page_table_update_sized(pt, vpn_2m, NO_MAPPING, PAGE_SIZE_2M) == 0);
+	assert(page_table_query(pt, vpn_2m + 12) == NO_MAPPING);
+
+	/* A 1 GiB page at level 2, split down twice */
+	assert(page_table_update_sized(pt, vpn_1g, 0x80000, PAGE_SIZE_1G) == 0);
+	assert(raw_pte(pt, vpn_1g, 2) & 0x2);
+	assert(page_table_query(pt, vpn_1g + 0x3ffff) == 0x80000 + 0x3ffff);
+	page_table_update(pt, vpn_1g + 0x1234, NO_MAPPING);
+	assert(page_table_query(pt, vpn_1g + 0x1234) == NO_MAPPING);
+	assert(page_table_query(pt, vpn_1g + 0x1235) == 0x80000 + 0x1235);
+	assert(raw_pte(pt, vpn_1g + 0x20000, 3) & 0x2);
+
+	/* Aligned ranges are promoted to huge pages, the unaligned edges aren't */
+	page_table_update_range(pt, vpn_2m - 3, 0x1000 - 3, 3 * 512 + 10);
+	assert(raw_pte(pt, vpn_2m + 512, 3) & 0x2);
+	assert(!(raw_pte(pt, vpn_2m + 3 * 512, 3) & 0x2));
+	for (uint64_t i = 0; i < 3 * 512 + 10; i++)
+		assert(page_table_query(pt, vpn_2m - 3 + i) == 0x1000 - 3 + i);
+	printf("PASSED HUGE PAGE SUITE\n\n");
+}
+
+void test_suite_reclaim(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t base = frames_in_use();
+
+	/* One mapping needs a node at each of the 4 levels below the root */
+	page_table_update(pt, 0xcafecafeeee, 0xf00d);
+	assert(frames_in_use() == base + 4);
+	page_table_update(pt, 0xcafecafeeef, 0xf00e);
+	page_table_update(pt, 0xcafecafeeee, NO_MAPPING);
+	assert(frames_in_use() == base + 4);
+	page_table_update(pt, 0xcafecafeeef, NO_MAPPING);
+	assert(frames_in_use() == base);
+
+	/* Unmapping a range frees every leaf it empties, and their parents */
+	page_table_update_range(pt, 0x3fe00 - 5, 1, 5000);
+	page_table_update(pt, 0x3fe00 - 6, 0x42);
+	page_table_unmap_range(pt, 0x3fe00 - 5, 5000);
+	assert(frames_in_use() == base + 4);
+	assert(page_table_query(pt, 0x3fe00 - 6) == 0x42);
+	page_table_update(pt, 0x3fe00 - 6, NO_MAPPING);
+	assert(frames_in_use() == base);
+
+	/* A huge page replacing a subtree frees it */
+	page_table_update(pt, 0x40000 + 17, 0x42);
+	page_table_update_sized(pt, 0x40000, 0, PAGE_SIZE_1G);
+	assert(frames_in_use() == base + 2);
+	page_table_update(pt, 0x40000 + 17, NO_MAPPING);
+	assert(frames_in_use() == base + 4);
+	page_table_update_sized(pt, 0x40000, NO_MAPPING, PAGE_SIZE_1G);
+	assert(frames_in_use() == base);
+
+	for (int i = 0; i < power(2, 12); i++)
+		perform_random_move(pt);
+	page_table_unmap_range(pt, 0, VPN_MASK + 1);
+	assert(frames_in_use() == base);
+	printf("PASSED RECLAIM SUITE\n\n");
+}
+
+#define CONCURRENT_VPNS 64
+#define CONCURRENT_READERS 4
+
+struct concurrent_args {
+	uint64_t pt;
+	uint64_t *vpns;
+	volatile int *done;
+	uint64_t queries;
+};
+
+/* The PPN of vpns[i] always has i in bits 20 and up, whatever it is remapped to */
+void *concurrent_reader(void *arg) {
+	struct concurrent_args *args = arg;
+
+	while (!*args->done) {
+		for (uint64_t i = 0; i < CONCURRENT_VPNS; i++) {
+			uint64_t ppn = page_table_query_concurrent(args->pt, args->vpns[i]);
+			if (ppn != NO_MAPPING && (ppn >> 20) != i)
+				errx(1, "concurrent query of %lx returned %lx", args->vpns[i], ppn);
+		}
+		args->queries += CONCURRENT_VPNS;
+	}
+	return NULL;
+}
+
+void test_suite_concurrent(void) {
+	pthread_t readers[CONCURRENT_READERS];
+	struct concurrent_args args[CONCURRENT_READERS];
+	volatile int done = 0;
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns;
+
+	get_random_list(&vpns, CONCURRENT_VPNS, VPN_MASK);
+	for (int t = 0; t < CONCURRENT_READERS; t++) {
+		args[t] = (struct concurrent_args){pt, vpns, &done, 0};
+		pthread_create(&readers[t], NULL, concurrent_reader, &args[t]);
+	}
+
+	/* Unmapping frees the nodes out from under the readers every other round */
+	for (uint64_t round = 0; round < 2000; round++)
+		for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+			page_table_update_concurrent(pt, vpns[i],
+				round % 2 ? NO_MAPPING : (i << 20) | round);
+
+	done = 1;
+	for (int t = 0; t < CONCURRENT_READERS; t++)
+		pthread_join(readers[t], NULL);
+	for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+		assert(page_table_query(pt, vpns[i]) == NO_MAPPING);
+
+	/* Far more short-lived readers than there are reader slots, so exited
+	 * threads' slots get reused under updates */
+	for (uint64_t wave = 0; wave < 64; wave++) {
+		done = 0;
+		for (int t = 0; t < CONCURRENT_READERS; t++) {
+			args[t] = (struct concurrent_args){pt, vpns, &done, 0};
+			pthread_create(&readers[t], NULL, concurrent_reader, &args[t]);
+		}
+		for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+			page_table_update_concurrent(pt, vpns[i],
+				wave % 2 ? NO_MAPPING : (i << 20) | wave);
+		done = 1;
+		for (int t = 0; t < CONCURRENT_READERS; t++)
+			pthread_join(readers[t], NULL);
+	}
+	free(vpns);
+	printf("PASSED CONCURRENT SUITE\n\n");
+}
+
+void test_suite_walk_cache(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t walks, levels;
+
+	page_table_update(pt, 0x12345600, 0x1);
+	page_table_update(pt, 0x12345601, 0x2);
+
+	/* Nothing is counted unless asked for */
+	page_table_walk_stats_reset();
+	assert(page_table_query(pt, 0x12345600) == 0x1);
+	page_table_walk_stats(&walks, &levels);
+	assert(walks == 0 && levels == 0);
+
+	/* With the cache on, the second query only visits the last-level node */
+	assert(page_table_walk_cache_enable(pt) == 0);
+	page_table_walk_stats_enable(1);
+	assert(page_table_query(pt, 0x12345600) == 0x1);
+	assert(page_table_query(pt, 0x12345601) == 0x2);
+	page_table_walk_stats(&walks, &levels);
+	assert(walks == 2 && levels == 5 + 1);
+
+	/* Tables without a cache always walk from the root */
+	uint64_t uncached_pt = alloc_page_frame();
+	page_table_update(uncached_pt, 0x12345600, 0x1);
+	page_table_walk_stats_reset();
+	assert(page_table_query(uncached_pt, 0x12345600) == 0x1);
+	assert(page_table_query(uncached_pt, 0x12345600) == 0x1);
+	page_table_walk_stats(&walks, &levels);
+	assert(walks == 2 && levels == 5 + 5);
+	page_table_walk_stats_enable(0);
+	page_table_destroy(uncached_pt);
+
+	/* The cached node is freed when a huge page replaces it */
+	page_table_update_sized(pt, 0x12345600, 0x400, PAGE_SIZE_2M);
+	assert(page_table_query(pt, 0x12345601) == 0x401);
+
+	/* ... or when it empties */
+	page_table_update(pt, 0x12345600, 0x3);
+	assert(page_table_query(pt, 0x12345600) == 0x3);
+	page_table_unmap_range(pt, 0x12345600, 512);
+	assert(page_table_query(pt, 0x12345600) == NO_MAPPING);
+
+	/* Queries of other tables with the same VPN don't hit it */
+	uint64_t other_pt = alloc_page_frame();
+	page_table_walk_cache_enable(other_pt);
+	page_table_update(pt, 0x12345600, 0x4);
+	assert(page_table_query(pt, 0x12345600) == 0x4);
+	assert(page_table_query(other_pt, 0x12345600) == NO_MAPPING);
+
+	page_table_destroy(other_pt);
+
+	page_table_walk_cache_disable(pt);
+	for (int i = 0; i < power(2, 12); i++)
+		perform_random_move(pt);
+	page_table_walk_cache_enable(pt);
+	for (int i = 0; i < power(2, 12); i++)
+		perform_random_move(pt);
+	page_table_walk_cache_disable(pt);
+	printf("PASSED WALK CACHE SUITE\n\n");
+}
+
+void test_suite_batch(void) {
+	int n = 4096;
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns = malloc(sizeof(uint64_t) * n);
+	uint64_t *ppns = malloc(sizeof(uint64_t) * n);
+
+	page_table_update_range(pt, 0x7000000, 1, 3000);
+	page_table_update_sized(pt, 0x40000 * 3, 0x40000, PAGE_SIZE_1G);
+	page_table_update_sized(pt, 0x7200000, 0x200, PAGE_SIZE_2M);
+	for (int i = 0; i < 1000; i++)
+		page_table_update(pt, get_random_vpn(), get_random_ppn());
+
+	/* A mix of dense, huge, random and duplicate VPNs, in random order */
+	for (int i = 0; i < n; i++) {
+		switch (rand() % 5) {
+			case 0: vpns[i] = 0x7000000 + get_random(4095); break;
+			case 1: vpns[i] = 0x40000 * 3 + get_random(0x3ffff); break;
+			case 2: vpns[i] = 0x7200000 + get_random(1023); break;
+			case 3: vpns[i] = get_random_vpn(); break;
+			case 4: vpns[i] = vpns[rand() % (i + 1)]; break;
+		}
+	}
+	page_table_query_batch(pt, vpns, ppns, n);
+	for (int i = 0; i < n; i++)
+		assert_equal(ppns[i], page_table_query(pt, vpns[i]));
+
+	/* Already sorted input */
+	for (int i = 0; i < n; i++)
+		vpns[i] = 0x7000000 + i;
+	page_table_query_batch(pt, vpns, ppns, n);
+	for (int i = 0; i < n; i++)
+		assert_equal(ppns[i], i < 3000 ? i + 1 : NO_MAPPING);
+
+	page_table_query_batch(pt, vpns, ppns, 0);
+	free(vpns);
+	free(ppns);
+	printf("\nPASSED BATCH SUITE\n\n");
+}
+
+void test_suite_clone(void) {
+	uint64_t base = frames_in_use();
+	uint64_t pt = alloc_page_frame();
+	uint64_t clone, frames;
+	uint64_t *vpns;
+
+	page_table_update_range(pt, 0x3fe00 - 5, 1, 3000);
+	page_table_update_sized(pt, 0x40000 * 3, 0x40000, PAGE_SIZE_1G);
+
+	/* Cloning only copies the root */
+	frames = frames_in_use();
+	clone = page_table_clone(pt);
+	assert(frames_in_use() == frames + 1);
+	assert(page_table_query(clone, 0x3fe00) == 6);
+	assert(page_table_query(clone, 0x40000 * 3 + 5) == 0x40005);
+
+	/* The first write under a shared node copies the path down to it */
+	page_table_update(clone, 0x3fe00, 0xcafe);
+	assert(frames_in_use() == frames + 1 + 4);
+	assert(page_table_query(clone, 0x3fe00) == 0xcafe);
+	assert(page_table_query(pt, 0x3fe00) == 6);
+	page_table_update(pt, 0x3fe01, NO_MAPPING);
+	assert(page_table_query(pt, 0x3fe01) == NO_MAPPING);
+	assert(page_table_query(clone, 0x3fe01) == 7);
+	page_table_unmap_range(clone, 0x40000 * 3 + 7, 2);
+	assert(page_table_query(clone, 0x40000 * 3 + 8) == NO_MAPPING);
+	assert(page_table_query(pt, 0x40000 * 3 + 8) == 0x40008);
+
+	/* Random updates to a clone of a clone leave the other two alone */
+	uint64_t grandchild = page_table_clone(clone);
+	get_random_list(&vpns, 500, VPN_MASK);
+	for (int i = 0; i < 500; i++)
+		page_table_update(grandchild, vpns[i], i);
+	for (int i = 0; i < 500; i++) {
+		assert(page_table_query(grandchild, vpns[i]) == i);
+		assert(page_table_query(pt, vpns[i]) == page_table_query(clone, vpns[i]));
+	}
+	free(vpns);
+
+	/* More clones than a node can count sharers for */
+	uint64_t *clones = malloc(sizeof(uint64_t) * 1100);
+	for (int i = 0; i < 1100; i++)
+		clones[i] = page_table_clone(pt);
+	page_table_update(clones[1099], 0x3fe02, NO_MAPPING);
+	assert(page_table_query(clones[1098], 0x3fe02) == 8);
+	assert(page_table_query(clones[1099], 0x3fe02) == NO_MAPPING);
+	for (int i = 0; i < 1100; i++)
+		page_table_destroy(clones[i]);
+	free(clones);
+
+	/* Unmapping a whole shared subtree drops the walks cached through it */
+	uint64_t a = alloc_page_frame();
+	page_table_update(a, 0x40005, 0x1234);
+	uint64_t b = page_table_clone(a);
+	page_table_walk_cache_enable(a);
+	page_table_walk_cache_enable(b);
+	assert(page_table_query(a, 0x40005) == 0x1234);
+	page_table_unmap_range(a, 0x40000, 0x40000);
+	assert(page_table_query(a, 0x40005) == NO_MAPPING);
+	assert(page_table_query(b, 0x40005) == 0x1234);
+	page_table_destroy(a);
+
+	/* A table rooted at a destroyed clone's frame doesn't see its walks */
+	uint64_t d = page_table_clone(b);
+	page_table_walk_cache_enable(d);
+	assert(page_table_query(d, 0x40005) == 0x1234);
+	page_table_destroy(d);
+	uint64_t e = alloc_page_frame();
+	page_table_walk_cache_enable(e);
+	assert(page_table_query(e, 0x40005) == NO_MAPPING);
+	page_table_destroy(e);
+	page_table_destroy(b);
+
+	page_table_destroy(grandchild);
+	page_table_destroy(pt);
+	assert(page_table_query(clone, 0x3fe03) == 9);
+	page_table_destroy(clone);
+	assert(frames_in_use() == base);
+	printf("PASSED CLONE SUITE\n\n");
+}
+
+struct extent_list {
+	uint64_t vpn[16];
+	uint64_t ppn[16];
+	uint64_t count[16];
+	int n;
+	int max;
+};
+
+int collect_extent(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg) {
+	struct extent_list *list = arg;
+
+	assert(list->n < 16);
+	list->vpn[list->n] = vpn;
+	list->ppn[list->n] = ppn;
+	list->count[list->n] = count;
+	list->n++;
+	return list->n == list->max;
+}
+
+void assert_extent(struct extent_list *list, int i, uint64_t vpn, uint64_t ppn, uint64_t count) {
+	assert_equal(list->vpn[i], vpn);
+	assert_equal(list->ppn[i], ppn);
+	assert_equal(list->count[i], count);
+}
+
+void test_suite_for_each(void) {
+	uint64_t pt = alloc_page_frame();
+	struct extent_list list = {.n = 0, .max = 0};
+
+	/* A run across leaf boundaries and into a 2 MiB page is one extent */
+	page_table_update_range(pt, 0x3fe00 - 5, 0x3fe00 - 5, 5 + 512);
+	page_table_update_sized(pt, 0x40000, 0x40000, PAGE_SIZE_2M);
+	page_table_update(pt, 0x40000 + 512, 0x77);
+	page_table_update(pt, 0x40000 + 513, 0x78);
+	page_table_update(pt, 0x40000 + 515, 0x79);
+	page_table_update(pt, 0x1fffffffffff, 0x1);
+
+	page_table_for_each(pt, 0, VPN_MASK + 1, collect_extent, &list);
+	assert(list.n == 4);
+	assert_extent(&list, 0, 0x3fe00 - 5, 0x3fe00 - 5, 5 + 512 + 512);
+	assert_extent(&list, 1, 0x40000 + 512, 0x77, 2);
+	assert_extent(&list, 2, 0x40000 + 515, 0x79, 1);
+	assert_extent(&list, 3, 0x1fffffffffff, 0x1, 1);
+
+	/* Ranges clip extents, huge pages included */
+	list.n = 0;
+	page_table_for_each(pt, 0x40000 + 100, 0x40000 + 514, collect_extent, &list);
+	assert(list.n == 2);
+	assert_extent(&list, 0, 0x40000 + 100, 0x40000 + 100, 412);
+	assert_extent(&list, 1, 0x40000 + 512, 0x77, 2);
+
+	/* Stopping early */
+	list.n = 0;
+	list.max = 2;
+	page_table_for_each(pt, 0, VPN_MASK + 1, collect_extent, &list);
+	assert(list.n == 2);
+
+	list.n = 0;
+	list.max = 0;
+	page_table_for_each(pt, 0x1000000, 0x2000000, collect_extent, &list);
+	assert(list.n == 0);
+	page_table_destroy(pt);
+	printf("PASSED FOR EACH SUITE\n\n");
+}
+
+void test_suite_geometry(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t base = frames_in_use();
+	uint64_t leaf = 1ULL << PT_BITS_PER_LEVEL;
+	struct extent_list list = {.n = 0, .max = 0};
+	uint64_t walks, levels;
+
+	/* One mapping needs a node at each level below the root */
+	page_table_update(pt, VPN_MASK, 0x1);
+	assert(frames_in_use() == base + PT_LEVELS - 1);
+	assert(page_table_query(pt, VPN_MASK) == 0x1);
+	assert(page_table_query(pt, VPN_MASK - 1) == NO_MAPPING);
+
+	/* The neighbouring leaf only needs a node of its own */
+	page_table_update(pt, VPN_MASK - leaf, 0x2);
+	assert(frames_in_use() == base + PT_LEVELS);
+
+	/* A walk reads one PTE per level */
+	page_table_walk_stats_enable(1);
+	page_table_walk_stats_reset();
+	assert(page_table_query(pt, VPN_MASK - leaf) == 0x2);
+	page_table_walk_stats(&walks, &levels);
+	assert(walks == 1 && levels == PT_LEVELS);
+	page_table_walk_stats_enable(0);
+
+	/* Ranges cross leaf boundaries */
+	page_table_update_range(pt, leaf - 3, 0x100, 6);
+	for (uint64_t i = 0; i < 6; i++)
+		assert(page_table_query(pt, leaf - 3 + i) == 0x100 + i);
+
+	page_table_for_each(pt, 0, VPN_MASK + 1, collect_extent, &list);
+	assert(list.n == 3);
+	assert_extent(&list, 0, leaf - 3, 0x100, 6);
+	assert_extent(&list, 1, VPN_MASK - leaf, 0x2, 1);
+	assert_extent(&list, 2, VPN_MASK, 0x1, 1);
+
+	page_table_unmap_range(pt, 0, VPN_MASK + 1);
+	assert(frames_in_use() == base);
+	page_table_destroy(pt);
+
+#if PT_LEVELS <= 3
+	/* Small tables map huge pages straight from the root */
+	uint64_t span = 1ULL << (PT_BITS_PER_LEVEL * (PT_LEVELS - 1));
+	pt = alloc_page_frame();
+	page_table_update_range(pt, 0, span, span);
+	assert(frames_in_use() == base);
+	assert(page_table_query(pt, 5) == span + 5);
+	uint64_t clone = page_table_clone(pt);
+	assert(page_table_query(clone, span - 1) == 2 * span - 1);
+	page_table_destroy(clone);
+	list.n = 0;
+	page_table_for_each(pt, 0, VPN_MASK + 1, collect_extent, &list);
+	assert(list.n == 1);
+	assert_extent(&list, 0, 0, span, span);
+	page_table_destroy(pt);
+	assert(frames_in_use() == base - 1);
+#endif
+	printf("PASSED GEOMETRY SUITE (%d levels of %d bits)\n\n",
+	       PT_LEVELS, PT_BITS_PER_LEVEL);
+}
+#endif
+
+/* Only needs the calls every backend implements */
+void test_suite_backend(void) {
+	int n = 50000;
+	uint64_t stride = (VPN_MASK + 1) / n;
+	uint64_t base = frames_in_use();
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns = malloc(sizeof(uint64_t) * n);
+	uint64_t *ppns = malloc(sizeof(uint64_t) * n);
+
+	/* One VPN somewhere in each of n slices of the address space */
+	for (int i = 0; i < n; i++) {
+		vpns[i] = i * stride + rand() % stride;
+		page_table_update(pt, vpns[i], i);
+	}
+	for (int i = 0; i < n; i++)
+		assert_equal(page_table_query(pt, vpns[i]), i);
+
+	/* Unmapped VPNs must not hide the ones mapped after them */
+	for (int i = 0; i < n; i += 2)
+		page_table_update(pt, vpns[i], NO_MAPPING);
+	for (int i = 0; i < n; i++)
+		assert_equal(page_table_query(pt, vpns[i]), i % 2 ? i : NO_MAPPING);
+	for (int i = 0; i < n; i += 2)
+		page_table_update(pt, vpns[i], n + i);
+	page_table_query_batch(pt, vpns, ppns, n);
+	for (int i = 0; i < n; i++)
+		assert_equal(ppns[i], i % 2 ? i : n + i);
+
+	/* Emptying the table gives back everything but the root */
+	for (int i = 0; i < n; i++)
+		page_table_update(pt, vpns[i], NO_MAPPING);
+	assert(frames_in_use() == base + 1);
+	page_table_destroy(pt);
+	assert(frames_in_use() == base);
+	free(vpns);
+	free(ppns);
+	printf("\nPASSED BACKEND SUITE (%s)\n\n", BACKEND_NAME);
+}
+
+/* 
+	~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~BENCHMARKS~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+*/
+
+#define BENCH_QUERIES (1 << 24)
+#define BENCH_OPS (1 << 22)
+#define BENCH_DENSE_PAGES (1 << 18)
+/* Each sparse page costs about 4 nodes of its own */
+#define BENCH_SPARSE_PAGES (1 << 14)
+
+int compare_vpns(const void *a, const void *b) {
+	uint64_t vpn_a = *(const uint64_t *)a;
+	uint64_t vpn_b = *(const uint64_t *)b;
+	return (vpn_a > vpn_b) - (vpn_a < vpn_b);
+}
+
+/* xorshift64*, so workloads are the same whatever libc's rand() is */
+static uint64_t bench_rng_state = 0x9e3779b97f4a7c15;
+
+uint64_t bench_random(void) {
+	bench_rng_state ^= bench_rng_state >> 12;
+	bench_rng_state ^= bench_rng_state << 25;
+	bench_rng_state ^= bench_rng_state >> 27;
+	return bench_rng_state * 0x2545f4914f6cdd1d;
+}
+
+/* Hardware counters for a benchmark, or -1 where perf_event isn't available */
+struct perf_counters {
+	int cache_misses;
+	int dtlb_misses;
+};
+
+int perf_open(uint32_t type, uint64_t config) {
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+void perf_start(struct perf_counters *counters) {
+	int fds[] = {counters->cache_misses, counters->dtlb_misses};
+
+	for (int i = 0; i < 2; i++) {
+		if (fds[i] >= 0) {
+			ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+			ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+		}
+	}
+}
+
+/* Prints the counts per op, or '-' for counters that aren't there */
+void perf_stop(struct perf_counters *counters, uint64_t ops) {
+	int fds[] = {counters->cache_misses, counters->dtlb_misses};
+
+	for (int i = 0; i < 2; i++) {
+		uint64_t count;
+
+		if (fds[i] < 0 || (ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0),
+		                   read(fds[i], &count, sizeof(count)) != sizeof(count)))
+			printf(" %13s", "-");
+		else
+			printf(" %13.3f", (double)count / ops);
+	}
+}
+
+double now_seconds(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Pages mapped by a single last-level node */
+#define LEAF_PAGES	(1ULL << PT_BITS_PER_LEVEL)
+
+enum bench_access { ACCESS_SEQUENTIAL, ACCESS_STRIDED, ACCESS_RANDOM, ACCESS_ZIPFIAN };
+
+/* Picks the index (into the mapped VPNs) each op touches */
+void generate_accesses(uint32_t *indices, enum bench_access access, uint32_t npages) {
+	double *cdf = NULL;
+	uint32_t *ranks = NULL;
+
+	if (access == ACCESS_ZIPFIAN) {
+		/* Zipf with s = 0.99 over the pages, hottest ranks scattered at random */
+		double sum = 0;
+		cdf = malloc(sizeof(double) * npages);
+		ranks = malloc(sizeof(uint32_t) * npages);
+		for (uint32_t i = 0; i < npages; i++) {
+			sum += 1 / pow(i + 1, 0.99);
+			cdf[i] = sum;
+			ranks[i] = i;
+		}
+		for (uint32_t i = npages - 1; i > 0; i--) {
+			uint32_t j = bench_random() % (i + 1);
+			uint32_t tmp = ranks[i];
+			ranks[i] = ranks[j];
+			ranks[j] = tmp;
+		}
+		for (uint32_t i = 0; i < npages; i++)
+			cdf[i] /= sum;
+	}
+
+	for (uint32_t i = 0; i < BENCH_OPS; i++) {
+		switch (access) {
+			case ACCESS_SEQUENTIAL:
+				indices[i] = i % npages;
+				break;
+			case ACCESS_STRIDED:
+				/* A page per last-level node, wrapping around to the next one */
+				indices[i] = ((uint64_t)i * LEAF_PAGES +
+					      (uint64_t)i * LEAF_PAGES / npages) % npages;
+				break;
+			case ACCESS_RANDOM:
+				indices[i] = bench_random() % npages;
+				break;
+			case ACCESS_ZIPFIAN: {
+				double u = (bench_random() >> 11) * 0x1.0p-53;
+				uint32_t lo = 0, hi = npages - 1;
+				while (lo < hi) {
+					uint32_t mid = (lo + hi) / 2;
+					if (cdf[mid] < u)
+						lo = mid + 1;
+					else
+						hi = mid;
+				}
+				indices[i] = ranks[lo];
+				break;
+			}
+		}
+	}
+	free(cdf);
+	free(ranks);
+}
+
+/*
+ * Every combination of map (dense: one contiguous run, sparse: pages
+ * scattered over the whole address space), access pattern, and mix of
+ * queries and updates (remaps). Ops are generated up front, from a fixed
+ * seed, so only the page table is timed and runs are reproducible.
+ */
+void bench_workloads(int use_perf) {
+	const char *maps[] = {"dense", "sparse"};
+	const char *accesses[] = {"sequential", "strided", "random", "zipfian"};
+	const char *mixes[] = {"query-heavy", "update-heavy"};
+	int update_percent[] = {5, 50};
+	uint32_t *indices = malloc(sizeof(uint32_t) * BENCH_OPS);
+	uint8_t *is_update = malloc(BENCH_OPS);
+	uint64_t *vpns = malloc(sizeof(uint64_t) * BENCH_DENSE_PAGES);
+	struct perf_counters counters = {-1, -1};
+
+	if (use_perf) {
+		counters.cache_misses = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		counters.dtlb_misses = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB |
+		                                 (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		                                 (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	}
+
+	printf("%-6s %-10s %-12s %8s %8s %13s %13s\n", "map", "access", "mix", "ns/op",
+	       "nodes", "cache-miss/op", "dtlb-miss/op");
+	for (int map = 0; map < 2; map++) {
+		uint64_t pt = alloc_page_frame();
+		uint64_t frames = frames_in_use();
+		uint32_t npages = map == 0 ? BENCH_DENSE_PAGES : BENCH_SPARSE_PAGES;
+		uint64_t nodes;
+
+		bench_rng_state = 0x9e3779b97f4a7c15 + map;
+		for (uint64_t i = 0; i < npages; i++)
+			vpns[i] = map == 0 ? (VPN_MASK + 1) / 4 + i : bench_random() & VPN_MASK;
+		/* Sequential access should walk the sparse pages in VPN order too */
+		qsort(vpns, npages, sizeof(uint64_t), compare_vpns);
+		/* Unaligned PPNs keep the dense run from being promoted to huge pages */
+		for (uint64_t i = 0; i < npages; i++)
+			page_table_update(pt, vpns[i], i + 1);
+		nodes = frames_in_use() - frames;
+
+		for (int access = 0; access < 4; access++) {
+			generate_accesses(indices, access, npages);
+			for (int mix = 0; mix < 2; mix++) {
+				volatile uint64_t sink = 0;
+				double start;
+
+				for (uint32_t i = 0; i < BENCH_OPS; i++)
+					is_update[i] = bench_random() % 100 < update_percent[mix];
+
+				printf("%-6s %-10s %-12s", maps[map], accesses[access], mixes[mix]);
+				perf_start(&counters);
+				start = now_seconds();
+				for (uint32_t i = 0; i < BENCH_OPS; i++) {
+					uint64_t vpn = vpns[indices[i]];
+					if (is_update[i])
+						page_table_update(pt, vpn, i + 1);
+					else
+						sink += page_table_query(pt, vpn);
+				}
+				printf(" %8.2f %8lu", (now_seconds() - start) * 1e9 / BENCH_OPS, nodes);
+				perf_stop(&counters, BENCH_OPS);
+				printf("\n");
+			}
+		}
+		page_table_destroy(pt);
+	}
+
+	if (counters.cache_misses >= 0)
+		close(counters.cache_misses);
+	if (counters.dtlb_misses >= 0)
+		close(counters.dtlb_misses);
+	free(indices);
+	free(is_update);
+	free(vpns);
+}
+
+/*
+ * Footprint and latency of the page table on its own, for a dense run of
+ * pages and for pages scattered over the whole address space. Build against
+ * pt.c and against pt_hash.c to compare the two backends.
+ */
+void bench_backend(void) {
+	const char *maps[] = {"dense", "sparse"};
+	uint32_t sizes[] = {BENCH_DENSE_PAGES, BENCH_SPARSE_PAGES};
+	int nqueries = 1 << 20;
+	uint64_t *vpns = malloc(sizeof(uint64_t) * BENCH_DENSE_PAGES);
+	uint64_t *queries = malloc(sizeof(uint64_t) * nqueries);
+	uint64_t *ppns = malloc(sizeof(uint64_t) * nqueries);
+
+	printf("%-6s %-6s %10s %8s %10s %10s %10s\n", "table", "map", "KiB", "B/page",
+	       "map ns", "query ns", "batch ns");
+	for (int map = 0; map < 2; map++) {
+		uint64_t pt = alloc_page_frame();
+		uint64_t frames = frames_in_use();
+		uint32_t npages = sizes[map];
+		volatile uint64_t sink = 0;
+		double start, map_ns, query_ns, batch_ns;
+
+		bench_rng_state = 0x9e3779b97f4a7c15 + map;
+		for (uint64_t i = 0; i < npages; i++)
+			vpns[i] = map == 0 ? (VPN_MASK + 1) / 4 + i : bench_random() & VPN_MASK;
+		for (int i = 0; i < nqueries; i++)
+			queries[i] = vpns[bench_random() % npages];
+
+		start = now_seconds();
+		for (uint64_t i = 0; i < npages; i++)
+			page_table_update(pt, vpns[i], i + 1);
+		map_ns = (now_seconds() - start) * 1e9 / npages;
+		frames = frames_in_use() - frames;
+
+		start = now_seconds();
+		for (int i = 0; i < nqueries; i++)
+			sink += page_table_query(pt, queries[i]);
+		query_ns = (now_seconds() - start) * 1e9 / nqueries;
+
+		start = now_seconds();
+		page_table_query_batch(pt, queries, ppns, nqueries);
+		batch_ns = (now_seconds() - start) * 1e9 / nqueries;
+
+		printf("%-6s %-6s %10lu %8.1f %10.2f %10.2f %10.2f\n", BACKEND_NAME, maps[map],
+		       frames * 4, frames * 4096.0 / npages, map_ns, query_ns, batch_ns);
+		page_table_destroy(pt);
+	}
+	free(vpns);
+	free(queries);
+	free(ppns);
+}
+
+#ifndef PT_BACKEND_HASH
+/* Query a small, hot working set of VPNs over and over */
+double bench_hot_queries(uint64_t pt, uint64_t *vpns, int nvpns) {
+	volatile uint64_t sink = 0;
+	double start = now_seconds();
+
+	for (int i = 0; i < BENCH_QUERIES; i++)
+		sink += page_table_query(pt, vpns[i % nvpns]);
+
+	return BENCH_QUERIES / (now_seconds() - start);
+}
+
+void bench_tlb(void) {
+	int nvpns = 128;
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns;
+	uint64_t hits, misses;
+
+	srand(1);
+	get_random_list(&vpns, nvpns, VPN_MASK);
+	for (int i = 0; i < nvpns; i++)
+		page_table_update(pt, vpns[i], get_random_ppn());
+
+	printf("tlb off: %.2f Mqueries/s\n", bench_hot_queries(pt, vpns, nvpns) / 1e6);
+
+	page_table_tlb_enable(pt);
+	printf("tlb on:  %.2f Mqueries/s", bench_hot_queries(pt, vpns, nvpns) / 1e6);
+	page_table_tlb_stats(pt, &hits, &misses);
+	printf(" (%lu hits, %lu misses)\n", hits, misses);
+	page_table_tlb_disable(pt);
+
+	page_table_destroy(pt);
+	free(vpns);
+}
+
+#define BENCH_RANGE_PAGES (1 << 18)
+
+void bench_range(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t vpn = 0x123400000;
+	double start, per_page, ranged;
+
+	/* Populate the nodes first, so both runs time the same work. An
+	 * unaligned PPN keeps the range from being promoted to huge pages. */
+	page_table_update_range(pt, vpn, 1, BENCH_RANGE_PAGES);
+
+	start = now_seconds();
+	for (uint64_t i = 0; i < BENCH_RANGE_PAGES; i++)
+		page_table_update(pt, vpn + i, i + 1);
+	per_page = now_seconds() - start;
+
+	start = now_seconds();
+	page_table_update_range(pt, vpn, 1, BENCH_RANGE_PAGES);
+	ranged = now_seconds() - start;
+
+	printf("map %d pages: per-page %.2f ms, range %.2f ms\n", BENCH_RANGE_PAGES,
+	       per_page * 1e3, ranged * 1e3);
+	page_table_destroy(pt);
+}
+
+/* Random queries over a 1 GiB region, mapped with 4 KiB pages or one 1 GiB page */
+void bench_huge(void) {
+	uint64_t npages = 1 << 18;
+	uint64_t vpn = npages * 3;
+	uint64_t small_pt = alloc_page_frame();
+	uint64_t huge_pt = alloc_page_frame();
+	uint64_t *vpns = malloc(sizeof(uint64_t) * 4096);
+
+	for (int i = 0; i < 4096; i++)
+		vpns[i] = vpn + get_random(npages - 1);
+
+	/* An unaligned PPN keeps the range from being promoted */
+	page_table_update_range(small_pt, vpn, 1, npages);
+	page_table_update_sized(huge_pt, vpn, 0, PAGE_SIZE_1G);
+
+	printf("1 GiB as 4 KiB pages: %.2f Mqueries/s\n",
+	       bench_hot_queries(small_pt, vpns, 4096) / 1e6);
+	printf("1 GiB as a huge page: %.2f Mqueries/s\n",
+	       bench_hot_queries(huge_pt, vpns, 4096) / 1e6);
+	page_table_destroy(small_pt);
+	page_table_destroy(huge_pt);
+	free(vpns);
+}
+
+/* Churn: map a batch of random pages, then unmap them, and watch the footprint */
+void bench_reclaim(void) {
+	uint64_t base = frames_in_use();
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns;
+	double start = now_seconds();
+
+	printf("frames held by the table after each map/unmap round:");
+	for (int round = 0; round < 8; round++) {
+		get_random_list(&vpns, 2000, VPN_MASK);
+		for (int i = 0; i < 2000; i++)
+			page_table_update(pt, vpns[i], i);
+		for (int i = 0; i < 2000; i++)
+			page_table_update(pt, vpns[i], NO_MAPPING);
+		free(vpns);
+		printf(" %lu", frames_in_use() - base);
+	}
+	printf(" (%.2f ms)\n", (now_seconds() - start) * 1e3);
+	page_table_destroy(pt);
+	printf("frames held after destroying the table: %lu\n", frames_in_use() - base);
+}
+
+/* Aggregate query throughput of 1..8 readers, while one writer keeps remapping */
+void bench_concurrent(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns;
+
+	get_random_list(&vpns, CONCURRENT_VPNS, VPN_MASK);
+	for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+		page_table_update_concurrent(pt, vpns[i], i << 20);
+
+	for (int nreaders = 1; nreaders <= 8; nreaders *= 2) {
+		pthread_t readers[8];
+		struct concurrent_args args[8];
+		volatile int done = 0;
+		uint64_t queries = 0;
+		double start = now_seconds();
+
+		for (int t = 0; t < nreaders; t++) {
+			args[t] = (struct concurrent_args){pt, vpns, &done, 0};
+			pthread_create(&readers[t], NULL, concurrent_reader, &args[t]);
+		}
+		while (now_seconds() - start < 0.5)
+			for (uint64_t i = 0; i < CONCURRENT_VPNS; i++)
+				page_table_update_concurrent(pt, vpns[i], (i << 20) | rand() % 2);
+		done = 1;
+		for (int t = 0; t < nreaders; t++) {
+			pthread_join(readers[t], NULL);
+			queries += args[t].queries;
+		}
+		printf("%d readers + 1 writer: %.2f Mqueries/s\n", nreaders,
+		       queries / (now_seconds() - start) / 1e6);
+	}
+	page_table_destroy(pt);
+	free(vpns);
+}
+
+/* Last-level nodes the random scan spreads over, far more than the walk cache holds */
+#define WALK_CACHE_SPARSE_NODES	(1 << 13)
+
+/* A sequential scan over 64 MiB of 4 KiB pages, and a random one over one page
+ * in each of 8192 last-level nodes (16 GiB of VA), with and without the walk cache */
+void bench_walk_cache(void) {
+	int npages = 1 << 14;
+	uint64_t pt = alloc_page_frame();
+	uint64_t *sequential = malloc(sizeof(uint64_t) * npages);
+	uint64_t *random = malloc(sizeof(uint64_t) * npages);
+	uint64_t vpn = 0xabc00000;
+	uint64_t sparse = vpn + npages;
+
+	/* Unaligned PPNs keep the range from being promoted to huge pages */
+	page_table_update_range(pt, vpn, 1, npages);
+	for (uint64_t node = 0; node < WALK_CACHE_SPARSE_NODES; node++)
+		page_table_update(pt, sparse + node * LEAF_PAGES, node);
+	for (int i = 0; i < npages; i++) {
+		sequential[i] = vpn + i;
+		random[i] = sparse + get_random(WALK_CACHE_SPARSE_NODES - 1) * LEAF_PAGES;
+	}
+
+	page_table_walk_stats_enable(1);
+	for (int enabled = 0; enabled <= 1; enabled++) {
+		const char *names[] = {"sequential", "random"};
+		uint64_t *scans[] = {sequential, random};
+
+		if (enabled)
+			page_table_walk_cache_enable(pt);
+		for (int scan = 0; scan < 2; scan++) {
+			uint64_t walks, levels;
+			double rate;
+
+			page_table_walk_stats_reset();
+			rate = bench_hot_queries(pt, scans[scan], npages);
+			page_table_walk_stats(&walks, &levels);
+			printf("walk cache %s, %-10s scan: %.2f Mqueries/s, %.2f levels/walk\n",
+			       enabled ? "on " : "off", names[scan], rate / 1e6,
+			       (double)levels / walks);
+		}
+	}
+	page_table_walk_stats_enable(0);
+	page_table_destroy(pt);
+	free(sequential);
+	free(random);
+}
+
+/* Batches of random translations over 1 GiB of 4 KiB pages, one by one and batched */
+void bench_batch(void) {
+	int n = 1 << 16;
+	int rounds = 64;
+	uint64_t npages = 1 << 18;
+	uint64_t pt = alloc_page_frame();
+	uint64_t *vpns = malloc(sizeof(uint64_t) * n);
+	uint64_t *ppns = malloc(sizeof(uint64_t) * n);
+	double start;
+
+	page_table_update_range(pt, npages, 1, npages);
+	for (int i = 0; i < n; i++)
+		vpns[i] = npages + get_random(npages - 1);
+
+	start = now_seconds();
+	for (int round = 0; round < rounds; round++)
+		for (int i = 0; i < n; i++)
+			ppns[i] = page_table_query(pt, vpns[i]);
+	printf("one by one: %.2f Mqueries/s\n", (double)n * rounds / (now_seconds() - start) / 1e6);
+
+	start = now_seconds();
+	for (int round = 0; round < rounds; round++)
+		page_table_query_batch(pt, vpns, ppns, n);
+	printf("batched:    %.2f Mqueries/s\n", (double)n * rounds / (now_seconds() - start) / 1e6);
+
+	qsort(vpns, n, sizeof(uint64_t), compare_vpns);
+	start = now_seconds();
+	for (int round = 0; round < rounds; round++)
+		page_table_query_batch(pt, vpns, ppns, n);
+	printf("batched, sorted: %.2f Mqueries/s\n", (double)n * rounds / (now_seconds() - start) / 1e6);
+	page_table_destroy(pt);
+	free(vpns);
+	free(ppns);
+}
+
+/* Snapshot a table of 1 GiB of 4 KiB pages, then write to it */
+void bench_clone(void) {
+	uint64_t npages = 1 << 18;
+	uint64_t pt = alloc_page_frame();
+	uint64_t clone, frames;
+	double start;
+
+	page_table_update_range(pt, npages, 1, npages);
+
+	frames = frames_in_use();
+	start = now_seconds();
+	clone = page_table_clone(pt);
+	printf("clone: %.2f us, %lu frames", (now_seconds() - start) * 1e6,
+	       frames_in_use() - frames);
+
+	frames = frames_in_use();
+	start = now_seconds();
+	for (int i = 0; i < 1000; i++)
+		page_table_update(clone, npages + get_random(npages - 1), i);
+	printf("; 1000 random writes after: %.2f us, %lu frames copied\n",
+	       (now_seconds() - start) * 1e6, frames_in_use() - frames);
+
+	page_table_destroy(clone);
+	page_table_destroy(pt);
+}
+
+int count_extent(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg) {
+	uint64_t *totals = arg;
+
+	totals[0]++;
+	totals[1] += count;
+	return 0;
+}
+
+/* Dump a table with one dense 1 GiB run and scattered random pages */
+void bench_for_each(void) {
+	uint64_t npages = 1 << 18;
+	uint64_t pt = alloc_page_frame();
+	uint64_t totals[2] = {0, 0};
+	double start;
+
+	page_table_update_range(pt, npages, 1, npages);
+	for (int i = 0; i < 10000; i++)
+		page_table_update(pt, get_random_vpn(), get_random_ppn());
+
+	start = now_seconds();
+	page_table_for_each(pt, 0, VPN_MASK + 1, count_extent, totals);
+	printf("for_each: %lu extents covering %lu pages in %.2f ms\n", totals[0],
+	       totals[1], (now_seconds() - start) * 1e3);
+	page_table_destroy(pt);
+}
+#endif
+
+/* Sparse random mappings need fresh nodes, so this is mostly frame allocation */
+void bench_alloc(void) {
+	uint64_t pt = alloc_page_frame();
+	uint64_t frames = frames_in_use();
+	double start = now_seconds();
+
+	for (int i = 0; i < 50000; i++)
+		page_table_update(pt, get_random_vpn(), i);
+	printf("50000 sparse mappings: %.2f ms, %lu frames\n",
+	       (now_seconds() - start) * 1e3, frames_in_use() - frames);
+	page_table_destroy(pt);
+}
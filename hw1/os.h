@@ -1,12 +1,89 @@
 
+#include <stddef.h>
 #include <stdint.h>
 
 #define NO_MAPPING	(~0ULL)
 
+/* Page-table geometry, overridable at build time: -DPT_LEVELS=4 gives a
+ * 4-level table over a 36-bit VPN (48-bit addresses). Nodes are single
+ * frames, so a level indexes at most 9 bits. The tests are run with 2 to 5
+ * levels, and with -DPT_LEVELS=6 -DPT_BITS_PER_LEVEL=8. */
+#ifndef PT_LEVELS
+#define PT_LEVELS	5
+#endif
+#ifndef PT_BITS_PER_LEVEL
+#define PT_BITS_PER_LEVEL	9
+#endif
+#define PT_VPN_BITS	(PT_LEVELS * PT_BITS_PER_LEVEL)
+
 uint64_t alloc_page_frame(void);
+void free_page_frame(uint64_t ppn);
 void* phys_to_virt(uint64_t phys_addr);
 
+/* Backends for the three calls above. Must be chosen before any frame is
+ * allocated, since frames can't move between them. */
+struct frame_allocator {
+	const char* name;
+	uint64_t (*alloc)(void);
+	void (*free)(uint64_t ppn);
+	void* (*phys_to_virt)(uint64_t phys_addr);
+	uint64_t (*in_use)(void);
+};
+void set_frame_allocator(const struct frame_allocator* allocator);
+
+/* One mmap per frame (the default) */
+extern const struct frame_allocator mmap_frame_allocator;
+
+/* Bump/free-list allocation out of a single reservation of nframes frames */
+#define ARENA_HUGETLB	0x1	/* Back the arena with huge pages */
+#define ARENA_POPULATE	0x2	/* Pre-fault the whole arena */
+extern const struct frame_allocator arena_frame_allocator;
+int arena_frame_allocator_init(uint64_t nframes, int flags);
+
+/* pt.c, a radix tree, implements every call below. pt_hash.c, a hash table
+ * built instead of it with -DPT_BACKEND_HASH, only implements update, query,
+ * the range calls, page_table_query_batch and page_table_destroy. */
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn);
 uint64_t page_table_query(uint64_t pt, uint64_t vpn);
 
+/* Map [vpn_start, vpn_start + count) to consecutive PPNs, or unmap it */
+void page_table_update_range(uint64_t pt, uint64_t vpn_start, uint64_t ppn_start, uint64_t count);
+void page_table_unmap_range(uint64_t pt, uint64_t vpn_start, uint64_t count);
+
+/* Map a single 4 KiB, 2 MiB or 1 GiB page. vpn and ppn must be aligned to the
+ * page size (in 4 KiB units). Returns 0 on success, -1 otherwise. */
+enum page_size { PAGE_SIZE_4K, PAGE_SIZE_2M, PAGE_SIZE_1G };
+int page_table_update_sized(uint64_t pt, uint64_t vpn, uint64_t ppn, enum page_size size);
+
+/* Copy-on-write clone of a whole page table, and teardown of either copy */
+uint64_t page_table_clone(uint64_t pt);
+void page_table_destroy(uint64_t pt);
+
+/* Visit the mappings in [vpn_lo, vpn_hi) in VPN order, as extents of
+ * consecutive VPNs mapped to consecutive PPNs. Return nonzero to stop. */
+typedef int (*page_table_extent_fn)(uint64_t vpn, uint64_t ppn, uint64_t count, void *arg);
+void page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi, page_table_extent_fn callback, void *arg);
+
+/* Translate n VPNs at once, sharing the walks of VPNs with common prefixes */
+void page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t *ppns, size_t n);
+
+/* Thread-safe variants: queries never block, updates are serialized */
+void page_table_update_concurrent(uint64_t pt, uint64_t vpn, uint64_t ppn);
+uint64_t page_table_query_concurrent(uint64_t pt, uint64_t vpn);
+
+/* Optional software TLB in front of page_table_query (see pt.c) */
+int page_table_tlb_enable(uint64_t pt);
+void page_table_tlb_disable(uint64_t pt);
+void page_table_tlb_stats(uint64_t pt, uint64_t *hits, uint64_t *misses);
+
+/* Optional page-walk cache of last-level nodes in front of page_table_query
+ * (see pt.c). Like the TLB, it isn't thread-safe. */
+int page_table_walk_cache_enable(uint64_t pt);
+void page_table_walk_cache_disable(uint64_t pt);
+
+/* Walk statistics, only counted while enabled: walks done by
+ * page_table_query and page_table_query_batch, and the nodes they visited */
+void page_table_walk_stats_enable(int enable);
+void page_table_walk_stats(uint64_t *walks, uint64_t *levels_walked);
+void page_table_walk_stats_reset(void);
 
@@ -1,61 +1,1074 @@
 #include "os.h"
+#include <pthread.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 
-#define NEW_VALID_PTE(ppn) ((ppn << 12) | 0x1)
-#define VPN_TO_INDEX(vpn, level) (vpn >> (9 * (4 - level))) & 0x1ffULL
+#if PT_LEVELS < 2 || PT_BITS_PER_LEVEL < 2 || PT_BITS_PER_LEVEL > 9
+#error "Nodes are single frames: each level may index 2 to 9 bits"
+#endif
+#if PT_VPN_BITS > 52
+#error "VPNs wider than 52 bits don't fit a 64-bit virtual address"
+#endif
+
+// Levels are numbered from 0 (the root) to `LAST_LEVEL`, whose PTEs map pages
+#define LAST_LEVEL (PT_LEVELS - 1)
+#define NODE_ENTRIES (1 << PT_BITS_PER_LEVEL)
+
+#define NEW_VALID_PTE(ppn) (((ppn) << 12) | PTE_VALID)
+#define VPN_TO_INDEX(vpn, level)                                               \
+    (((vpn) >> (PT_BITS_PER_LEVEL * (LAST_LEVEL - (level)))) &                 \
+     (NODE_ENTRIES - 1ULL))
+// Number of VPNs covered by a single PTE at `level`
+#define LEVEL_SPAN(level) (1ULL << (PT_BITS_PER_LEVEL * (LAST_LEVEL - (level))))
+
+// Walks have at most `PT_LEVELS` steps, so loops over the levels are fully
+// unrolled, leaving a straight-line walk specialized for the geometry.
+// Unoptimized builds don't unroll, and warn about the pragma.
+#ifdef __OPTIMIZE__
+#define UNROLL_LEVELS _Pragma("GCC unroll 8")
+#else
+#define UNROLL_LEVELS
+#endif
+
+#define PTE_ADDR_MASK (~0xfffULL)
+#define PTE_VALID 0x1ULL
+// A valid PTE above the last level that maps a huge page instead of pointing
+// to the next node. Lives in bit 1, so bits 2-11 stay free.
+#define PTE_HUGE 0x2ULL
+// Bits 2-11 of the first PTE in every node hold the node's population: the
+// number of valid PTEs in it. The same bits of the second PTE hold the number
+// of extra page tables sharing the node (see `page_table_clone`). All writes
+// to PTEs must preserve these bits.
+#define PTE_META_SHIFT 2
+#define PTE_META_MASK (0x3ffULL << PTE_META_SHIFT)
+#define PTE_META_MAX (PTE_META_MASK >> PTE_META_SHIFT)
+#define NODE_POPULATION(node) (((node)[0] & PTE_META_MASK) >> PTE_META_SHIFT)
+#define NODE_SHARERS(node) (((node)[1] & PTE_META_MASK) >> PTE_META_SHIFT)
+
+// PTEs may be read by concurrent queries while they are written, so they are
+// always published with release stores, and read with acquire loads on the
+// concurrent query path.
+#define LOAD_PTE(pte) __atomic_load_n((pte), __ATOMIC_ACQUIRE)
+#define STORE_PTE(pte, value) __atomic_store_n((pte), (value), __ATOMIC_RELEASE)
+
+#define MAX_READERS 64
+
+#define PWC_ENTRIES 64
+#define MAX_PWCS 8
+// Last-level nodes are shared by all VPNs with the same prefix above the
+// last level's index
+#define VPN_PREFIX(vpn) ((vpn) >> PT_BITS_PER_LEVEL)
+// Huge pages may only be mapped by PTEs in the two levels above the last one
+// (1 GiB and 2 MiB pages with the default geometry)
+#define HUGE_MIN_LEVEL (LAST_LEVEL > 2 ? LAST_LEVEL - 2 : 0)
+
+#define TLB_SETS 64
+#define TLB_WAYS 4
+#define MAX_TLBS 8
+#define TLB_SET(vpn) ((vpn) & (TLB_SETS - 1))
+
+struct tlb_entry {
+    uint64_t vpn; // `NO_MAPPING` for an empty entry
+    uint64_t ppn;
+};
+
+/**
+ * A set-associative software TLB, caching the translations of a single page
+ * table. Entries are replaced round-robin within a set.
+ * */
+struct tlb {
+    uint64_t pt;
+    int in_use;
+    struct tlb_entry entries[TLB_SETS][TLB_WAYS];
+    uint8_t next_victim[TLB_SETS];
+    uint64_t hits;
+    uint64_t misses;
+};
+
+static struct tlb tlbs[MAX_TLBS];
+static int tlbs_in_use = 0;
+
+/**
+ * Returns the TLB of the page table `pt`, or NULL if it doesn't have one.
+ * */
+static struct tlb *find_tlb(uint64_t pt) {
+    if (!tlbs_in_use)
+        return NULL;
+    for (int i = 0; i < MAX_TLBS; i++) {
+        if (tlbs[i].in_use && tlbs[i].pt == pt)
+            return &tlbs[i];
+    }
+    return NULL;
+}
+
+static void tlb_flush(struct tlb *tlb) {
+    for (int set = 0; set < TLB_SETS; set++) {
+        for (int way = 0; way < TLB_WAYS; way++) {
+            tlb->entries[set][way].vpn = NO_MAPPING;
+        }
+        tlb->next_victim[set] = 0;
+    }
+}
+
+static struct tlb_entry *tlb_lookup(struct tlb *tlb, uint64_t vpn) {
+    struct tlb_entry *set = tlb->entries[TLB_SET(vpn)];
+    for (int way = 0; way < TLB_WAYS; way++) {
+        if (set[way].vpn == vpn)
+            return &set[way];
+    }
+    return NULL;
+}
+
+static void tlb_insert(struct tlb *tlb, uint64_t vpn, uint64_t ppn) {
+    uint64_t set = TLB_SET(vpn);
+    struct tlb_entry *entry = &tlb->entries[set][tlb->next_victim[set]];
+    tlb->next_victim[set] = (tlb->next_victim[set] + 1) % TLB_WAYS;
+    entry->vpn = vpn;
+    entry->ppn = ppn;
+}
+
+static void tlb_invalidate(struct tlb *tlb, uint64_t vpn) {
+    struct tlb_entry *entry = tlb_lookup(tlb, vpn);
+    if (entry)
+        entry->vpn = NO_MAPPING;
+}
+
+/**
+ * Invalidates every entry for a VPN in `[vpn, vpn + count)`. Large ranges are
+ * cheaper to handle by scanning the whole TLB once.
+ * */
+static void tlb_invalidate_range(struct tlb *tlb, uint64_t vpn,
+                                 uint64_t count) {
+    if (count < TLB_SETS * TLB_WAYS) {
+        for (uint64_t i = 0; i < count; i++) {
+            tlb_invalidate(tlb, vpn + i);
+        }
+        return;
+    }
+    for (int set = 0; set < TLB_SETS; set++) {
+        for (int way = 0; way < TLB_WAYS; way++) {
+            struct tlb_entry *entry = &tlb->entries[set][way];
+            if (entry->vpn != NO_MAPPING && entry->vpn - vpn < count)
+                entry->vpn = NO_MAPPING;
+        }
+    }
+}
+
+int page_table_tlb_enable(uint64_t pt) {
+    if (find_tlb(pt))
+        return 0;
+    for (int i = 0; i < MAX_TLBS; i++) {
+        if (!tlbs[i].in_use) {
+            tlb_flush(&tlbs[i]);
+            tlbs[i].pt = pt;
+            tlbs[i].hits = 0;
+            tlbs[i].misses = 0;
+            tlbs[i].in_use = 1;
+            tlbs_in_use++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void page_table_tlb_disable(uint64_t pt) {
+    struct tlb *tlb = find_tlb(pt);
+    if (!tlb)
+        return;
+    tlb->in_use = 0;
+    tlbs_in_use--;
+}
+
+void page_table_tlb_stats(uint64_t pt, uint64_t *hits, uint64_t *misses) {
+    struct tlb *tlb = find_tlb(pt);
+    *hits = tlb ? tlb->hits : 0;
+    *misses = tlb ? tlb->misses : 0;
+}
+
+/**
+ * A direct-mapped page-walk cache of a single page table, remembering the
+ * last-level node that recent walks ended at, keyed by VPN prefix. A query
+ * hitting it reads the PTE straight from the cached node, skipping the levels
+ * above it. Entries are dropped whenever their node is unlinked from the page
+ * table, or, since a node shared with other tables outlives being detached
+ * from one, whenever a subtree is detached from the table.
+ * */
+struct pwc_entry {
+    uint64_t prefix;
+    uint64_t *node; // NULL for an empty entry
+};
+
+struct pwc {
+    uint64_t pt;
+    int in_use;
+    struct pwc_entry entries[PWC_ENTRIES];
+};
+
+static struct pwc pwcs[MAX_PWCS];
+static int pwcs_in_use = 0;
+
+// Walk instrumentation: full or partial walks done, and nodes they visited.
+// Only counted while enabled, so queries don't write shared state otherwise.
+static int walk_stats_enabled = 0;
+static uint64_t walks = 0;
+static uint64_t levels_walked = 0;
+
+/**
+ * Returns the page-walk cache of the page table `pt`, or NULL if it doesn't
+ * have one.
+ * */
+static struct pwc *find_pwc(uint64_t pt) {
+    if (!pwcs_in_use)
+        return NULL;
+    for (int i = 0; i < MAX_PWCS; i++) {
+        if (pwcs[i].in_use && pwcs[i].pt == pt)
+            return &pwcs[i];
+    }
+    return NULL;
+}
+
+static struct pwc_entry *pwc_slot(struct pwc *pwc, uint64_t vpn) {
+    return &pwc->entries[VPN_PREFIX(vpn) % PWC_ENTRIES];
+}
+
+static uint64_t *pwc_lookup(struct pwc *pwc, uint64_t vpn) {
+    struct pwc_entry *entry = pwc_slot(pwc, vpn);
+    if (entry->node && entry->prefix == VPN_PREFIX(vpn))
+        return entry->node;
+    return NULL;
+}
+
+static void pwc_insert(struct pwc *pwc, uint64_t vpn, uint64_t *node) {
+    struct pwc_entry *entry = pwc_slot(pwc, vpn);
+    entry->prefix = VPN_PREFIX(vpn);
+    entry->node = node;
+}
+
+/**
+ * Drops the entries of every cache leading to `node`, which some table just
+ * unlinked.
+ * */
+static void pwc_invalidate_node(uint64_t *node) {
+    if (!pwcs_in_use)
+        return;
+    for (int i = 0; i < MAX_PWCS; i++) {
+        if (!pwcs[i].in_use)
+            continue;
+        for (int j = 0; j < PWC_ENTRIES; j++) {
+            if (pwcs[i].entries[j].node == node)
+                pwcs[i].entries[j].node = NULL;
+        }
+    }
+}
+
+/**
+ * Drops the entries of `pt` for the `count` VPNs from `vpn`, once the nodes
+ * under them are no longer part of `pt`.
+ * */
+static void pwc_invalidate_range(uint64_t pt, uint64_t vpn, uint64_t count) {
+    struct pwc *pwc = find_pwc(pt);
+    if (!pwc)
+        return;
+    uint64_t first = VPN_PREFIX(vpn);
+    uint64_t last = VPN_PREFIX(vpn + count - 1);
+    for (int i = 0; i < PWC_ENTRIES; i++) {
+        struct pwc_entry *entry = &pwc->entries[i];
+        if (entry->node && entry->prefix >= first && entry->prefix <= last)
+            entry->node = NULL;
+    }
+}
+
+int page_table_walk_cache_enable(uint64_t pt) {
+    if (find_pwc(pt))
+        return 0;
+    for (int i = 0; i < MAX_PWCS; i++) {
+        if (!pwcs[i].in_use) {
+            for (int j = 0; j < PWC_ENTRIES; j++) {
+                pwcs[i].entries[j].node = NULL;
+            }
+            pwcs[i].pt = pt;
+            pwcs[i].in_use = 1;
+            pwcs_in_use++;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void page_table_walk_cache_disable(uint64_t pt) {
+    struct pwc *pwc = find_pwc(pt);
+    if (!pwc)
+        return;
+    pwc->in_use = 0;
+    pwcs_in_use--;
+}
+
+void page_table_walk_stats_enable(int enable) {
+    walk_stats_enabled = enable;
+}
+
+void page_table_walk_stats(uint64_t *walk_count, uint64_t *levels) {
+    *walk_count = walks;
+    *levels = levels_walked;
+}
+
+void page_table_walk_stats_reset(void) {
+    walks = 0;
+    levels_walked = 0;
+}
+
+/**
+ * Epoch-based reclamation for nodes unlinked while concurrent queries may
+ * still be walking them. Each reader thread owns a slot announcing the epoch
+ * it entered at (shifted left, with bit 0 set while inside a query). A frame
+ * retired at epoch `e` is only freed once the global epoch reaches `e + 2`,
+ * since by then every reader that could have seen it has left. A thread's
+ * slot is returned when it exits. While all `MAX_READERS` slots are taken,
+ * other threads fall back to taking the writer lock for their queries, and
+ * try again for a slot once one is returned.
+ * */
+static uint64_t global_epoch = 1;
+static uint64_t reader_epochs[MAX_READERS];
+static __thread int reader_slot = -1;
+
+// Slots returned by exited threads, reused before never-used ones
+static int free_slots[MAX_READERS];
+static int free_slot_count = 0;
+static int readers_registered = 0;
+static pthread_mutex_t slots_lock = PTHREAD_MUTEX_INITIALIZER;
+// Holds `reader_slot + 1` for each thread with a slot, so it is returned on
+// exit
+static pthread_key_t reader_key;
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+
+struct retired_frames {
+    uint64_t *frames;
+    size_t count;
+    size_t capacity;
+};
+
+static struct retired_frames retired[3];
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set while a concurrent update holds `writer_lock`
+static int defer_frees = 0;
+
+static void release_reader_slot(void *value) {
+    int slot = (int)(intptr_t)value - 1;
+    __atomic_store_n(&reader_epochs[slot], 0, __ATOMIC_RELEASE);
+    pthread_mutex_lock(&slots_lock);
+    free_slots[free_slot_count] = slot;
+    __atomic_store_n(&free_slot_count, free_slot_count + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&slots_lock);
+}
+
+static void create_reader_key(void) {
+    pthread_key_create(&reader_key, release_reader_slot);
+}
+
+/**
+ * Gives the calling thread a reader slot, or `MAX_READERS` if none is left.
+ * */
+static int claim_reader_slot(void) {
+    int slot = MAX_READERS;
+    pthread_once(&reader_key_once, create_reader_key);
+    pthread_mutex_lock(&slots_lock);
+    if (free_slot_count > 0) {
+        slot = free_slots[free_slot_count - 1];
+        __atomic_store_n(&free_slot_count, free_slot_count - 1,
+                         __ATOMIC_RELAXED);
+    } else if (readers_registered < MAX_READERS) {
+        slot = readers_registered++;
+    }
+    pthread_mutex_unlock(&slots_lock);
+    if (slot < MAX_READERS)
+        pthread_setspecific(reader_key, (void *)(intptr_t)(slot + 1));
+    return slot;
+}
+
+static void epoch_enter(void) {
+    if (reader_slot < 0 ||
+        (reader_slot >= MAX_READERS &&
+         __atomic_load_n(&free_slot_count, __ATOMIC_RELAXED) > 0))
+        reader_slot = claim_reader_slot();
+    if (reader_slot >= MAX_READERS) {
+        pthread_mutex_lock(&writer_lock);
+        return;
+    }
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    // Must be visible before any PTE is read, hence the full fence
+    __atomic_store_n(&reader_epochs[reader_slot], (epoch << 1) | 1,
+                     __ATOMIC_SEQ_CST);
+}
+
+static void epoch_exit(void) {
+    if (reader_slot >= MAX_READERS) {
+        pthread_mutex_unlock(&writer_lock);
+        return;
+    }
+    __atomic_store_n(&reader_epochs[reader_slot], 0, __ATOMIC_RELEASE);
+}
+
+static void free_retired(struct retired_frames *list) {
+    for (size_t i = 0; i < list->count; i++) {
+        free_page_frame(list->frames[i]);
+    }
+    list->count = 0;
+}
+
+/**
+ * Advances the global epoch if every reader inside a query has seen the
+ * current one, and frees the frames that are now unreachable.
+ * */
+static void epoch_collect(void) {
+    uint64_t epoch = global_epoch;
+    for (int i = 0; i < MAX_READERS; i++) {
+        uint64_t announced =
+            __atomic_load_n(&reader_epochs[i], __ATOMIC_SEQ_CST);
+        if ((announced & 1) && (announced >> 1) != epoch)
+            return;
+    }
+    __atomic_store_n(&global_epoch, epoch + 1, __ATOMIC_RELEASE);
+    free_retired(&retired[(epoch + 1) % 3]);
+}
+
+/**
+ * Frees a frame that was just unlinked from a page table, deferring it if
+ * concurrent queries may still be walking it.
+ * */
+static void release_frame(uint64_t frame) {
+    pwc_invalidate_node(phys_to_virt(frame << 12));
+    if (!defer_frees) {
+        free_page_frame(frame);
+        return;
+    }
+    struct retired_frames *list = &retired[global_epoch % 3];
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        uint64_t *frames = realloc(list->frames, capacity * sizeof(uint64_t));
+        if (!frames) {
+            // Leaking the frame is the only safe option left
+            return;
+        }
+        list->frames = frames;
+        list->capacity = capacity;
+    }
+    list->frames[list->count++] = frame;
+}
+
+static uint64_t *alloc_node(uint64_t *frame) {
+    *frame = alloc_page_frame();
+    uint64_t *new_node = phys_to_virt(*frame << 12);
+    memset((void *)new_node, 0, NODE_ENTRIES * sizeof(uint64_t));
+    return new_node;
+}
+
+/**
+ * Sets the PTE at `index` of `node` to `pte`, keeping the population of the
+ * node up to date.
+ * */
+static void set_pte(uint64_t *node, uint16_t index, uint64_t pte) {
+    uint64_t delta = (pte & PTE_VALID) - (node[index] & PTE_VALID);
+    STORE_PTE(&node[index], (node[index] & PTE_META_MASK) | pte);
+    if (delta)
+        STORE_PTE(&node[0], node[0] + (delta << PTE_META_SHIFT));
+}
+
+static void add_sharers(uint64_t *node, int64_t delta) {
+    STORE_PTE(&node[1], node[1] + ((uint64_t)delta << PTE_META_SHIFT));
+}
+
+/**
+ * Frees the node that `pte`, a valid non-huge PTE in a node at `level`,
+ * points to, along with every node below it. A node shared with other page
+ * tables is only unshared instead.
+ * */
+static void free_subtree(uint64_t pte, int level) {
+    uint64_t *node = phys_to_virt(pte & PTE_ADDR_MASK);
+    if (NODE_SHARERS(node) > 0) {
+        add_sharers(node, -1);
+        return;
+    }
+    if (level + 1 < LAST_LEVEL) {
+        uint64_t remaining = NODE_POPULATION(node);
+        for (int i = 0; i < NODE_ENTRIES && remaining; i++) {
+            if (!(node[i] & PTE_VALID))
+                continue;
+            remaining--;
+            if (!(node[i] & PTE_HUGE))
+                free_subtree(node[i], level + 1);
+        }
+    }
+    release_frame(pte >> 12);
+}
+
+static uint64_t *copy_node(uint64_t *node, int level, uint64_t *frame);
+
+/**
+ * Makes the node at `level` pointed to by the PTE at `index` of `parent`
+ * shared by one more page table. A node that can't count any more sharers is
+ * copied for the new sharer instead.
+ * */
+static void share_node(uint64_t *parent, uint16_t index, int level) {
+    uint64_t *node = phys_to_virt(parent[index] & PTE_ADDR_MASK);
+    if (NODE_SHARERS(node) < PTE_META_MAX) {
+        add_sharers(node, 1);
+        return;
+    }
+    uint64_t frame;
+    copy_node(node, level, &frame);
+    set_pte(parent, index, NEW_VALID_PTE(frame));
+}
+
+/**
+ * Copies `node`, a node at `level`, into a new unshared node. The nodes below
+ * it become shared between the two.
+ * */
+static uint64_t *copy_node(uint64_t *node, int level, uint64_t *frame) {
+    uint64_t *copy = alloc_node(frame);
+    memcpy(copy, node, NODE_ENTRIES * sizeof(uint64_t));
+    copy[1] &= ~PTE_META_MASK;
+    if (level < LAST_LEVEL) {
+        uint64_t remaining = NODE_POPULATION(copy);
+        for (int i = 0; i < NODE_ENTRIES && remaining; i++) {
+            if (!(copy[i] & PTE_VALID))
+                continue;
+            remaining--;
+            if (!(copy[i] & PTE_HUGE))
+                share_node(copy, i, level + 1);
+        }
+    }
+    return copy;
+}
+
+/**
+ * Gives the page table a private copy of `node`, the shared node at `level`
+ * pointed to by the PTE at `index` of `parent`. Returns the copy.
+ * */
+static uint64_t *unshare_node(uint64_t *parent, uint16_t index,
+                              uint64_t *node, int level) {
+    uint64_t frame;
+    uint64_t *copy = copy_node(node, level, &frame);
+    set_pte(parent, index, NEW_VALID_PTE(frame));
+    add_sharers(node, -1);
+    // The page-walk cache may still lead this table to the shared node
+    pwc_invalidate_node(node);
+    return copy;
+}
+
 /**
  * Gets the next node pointed to by the PTE at index, if it exists.
  * If it doesn't exist, if `create = 0`, return 0, if `create != 0`, allocate a
- * new page table node.
+ * new page table node. The PTE must not map a huge page.
+ *
+ * The new node is installed with a compare-and-swap, so if another thread
+ * installed one first, ours is dropped and theirs is returned.
  * */
 uint64_t *get_next_node(uint64_t *table_node, uint16_t index, int create) {
-    uint64_t pte = table_node[index];
-    if (pte & 0x1) {
+    uint64_t pte = LOAD_PTE(&table_node[index]);
+    if (pte & PTE_VALID) {
         // PTE is valid
-        uint64_t frame_address = pte & 0xfffffffffffffe00; // Zero last 12 bits
-        return phys_to_virt(frame_address);
+        return phys_to_virt(pte & PTE_ADDR_MASK);
     }
     if (!create) {
         return 0;
     }
-    uint64_t new_page = alloc_page_frame();
-    uint64_t new_pte = NEW_VALID_PTE(new_page);
-    table_node[index] = new_pte;
-    uint64_t *new_node = phys_to_virt(new_page << 12);
-    memset((void *)new_node, 0, 512);
+    uint64_t new_page;
+    uint64_t *new_node = alloc_node(&new_page);
+    uint64_t new_pte = (pte & PTE_META_MASK) | NEW_VALID_PTE(new_page);
+    if (!__atomic_compare_exchange_n(&table_node[index], &pte, new_pte, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        free_page_frame(new_page);
+        return phys_to_virt(pte & PTE_ADDR_MASK);
+    }
+    STORE_PTE(&table_node[0], table_node[0] + (1ULL << PTE_META_SHIFT));
     return new_node;
 }
 
-uint64_t *get_terminal_pte(uint64_t *table, uint64_t vpn, int create) {
+/**
+ * Replaces the huge page mapped by the PTE at `index` of `node`, a node at
+ * `level`, with a node mapping the same range using `NODE_ENTRIES` pages of the next
+ * level.
+ * */
+static void split_huge(uint64_t *node, uint16_t index, int level) {
+    uint64_t frame;
+    uint64_t *child = alloc_node(&frame);
+    uint64_t base = node[index] >> 12;
+    uint64_t flags = level + 1 < LAST_LEVEL ? PTE_HUGE : 0;
+    for (uint64_t i = 0; i < NODE_ENTRIES; i++) {
+        uint64_t ppn = base + i * LEVEL_SPAN(level + 1);
+        set_pte(child, i, NEW_VALID_PTE(ppn) | flags);
+    }
+    set_pte(node, index, NEW_VALID_PTE(frame));
+}
+
+/**
+ * Frees the now-empty nodes among `path[level + 1..depth]`, the path to
+ * `vpn`, from the bottom up, unlinking each from its parent. Stops at the
+ * first node that still has valid PTEs, since everything above it does too.
+ * */
+static void reclaim_path(uint64_t **path, uint64_t vpn, int level, int depth) {
+    for (int i = depth; i > level && NODE_POPULATION(path[i]) == 0; i--) {
+        uint16_t index = VPN_TO_INDEX(vpn, i - 1);
+        uint64_t frame = path[i - 1][index] >> 12;
+        set_pte(path[i - 1], index, 0);
+        release_frame(frame);
+    }
+}
+
+/**
+ * Returns the PTE that maps `vpn`, and sets `*level` to the level it lives
+ * at: `LAST_LEVEL` for a regular page, or a lower level for a huge page. Returns 0 if
+ * the walk hits an invalid PTE on the way, with `*level` set to the level it
+ * was found at.
+ * */
+uint64_t *get_terminal_pte(uint64_t *table, uint64_t vpn, int *level) {
     uint16_t index;
-    for (int i = 0; i < 4; i++) {
+    UNROLL_LEVELS
+    for (int i = 0; i < LAST_LEVEL; i++) {
         index = VPN_TO_INDEX(vpn, i);
-        table = get_next_node(table, index, create);
+        *level = i;
+        if (table[index] & PTE_HUGE)
+            return &table[index];
+        table = get_next_node(table, index, 0);
         if (!table)
             return 0;
     }
-    index = VPN_TO_INDEX(vpn, 4);
+    *level = LAST_LEVEL;
+    index = VPN_TO_INDEX(vpn, LAST_LEVEL);
     return &table[index];
 }
 
+/**
+ * Returns the highest level at which `a` and `b` index different PTEs, i.e.
+ * the first level whose node on the path to `b` may differ from the path to
+ * `a`. Returns `PT_LEVELS` if both are the same VPN.
+ * */
+static int first_diverging_level(uint64_t a, uint64_t b) {
+    int level = 0;
+    while (level < PT_LEVELS && VPN_TO_INDEX(a, level) == VPN_TO_INDEX(b, level)) {
+        level++;
+    }
+    return level;
+}
+
+/**
+ * Maps `[vpn, vpn + count)` to consecutive PPNs starting at `ppn`, or unmaps
+ * the range if `ppn = NO_MAPPING`. The path from the root is kept between
+ * pages, so a node is only visited again when the range crosses into a new
+ * subtree, and only the levels below the crossing are re-walked. When
+ * unmapping, missing subtrees are skipped whole.
+ *
+ * Whenever the range covers everything under a huge-capable PTE, and the PPN
+ * is aligned to match, a huge page is mapped there instead of a subtree (or
+ * the whole PTE is cleared, when unmapping). Huge pages only partially
+ * covered by the range are split first.
+ *
+ * Subtrees replaced this way are freed, and so is every node left empty
+ * once the walk moves past it. Shared nodes on the way are copied first.
+ * */
+static void update_range(uint64_t pt, uint64_t vpn, uint64_t ppn,
+                         uint64_t count) {
+    uint64_t *path[PT_LEVELS];
+    uint64_t end = vpn + count;
+    int create = ppn != NO_MAPPING;
+    int level = 0;
+    int depth = 0;
+    struct tlb *tlb = find_tlb(pt);
+    if (tlb)
+        tlb_invalidate_range(tlb, vpn, count);
+
+    path[0] = phys_to_virt(pt << 12);
+    while (vpn < end) {
+        uint64_t next;
+        for (; level < LAST_LEVEL; level++) {
+            uint16_t index = VPN_TO_INDEX(vpn, level);
+            uint64_t span = LEVEL_SPAN(level);
+            if (level >= HUGE_MIN_LEVEL && vpn % span == 0 &&
+                end - vpn >= span && (!create || ppn % span == 0))
+                break;
+            if (path[level][index] & PTE_HUGE)
+                split_huge(path[level], index, level);
+            path[level + 1] = get_next_node(path[level], index, create);
+            if (!path[level + 1])
+                break;
+            if (NODE_SHARERS(path[level + 1]) > 0)
+                path[level + 1] = unshare_node(path[level], index,
+                                               path[level + 1], level + 1);
+        }
+        depth = level;
+        if (level < LAST_LEVEL) {
+            // Either the range covers this whole PTE, or nothing is mapped
+            // under it and we are unmapping.
+            uint16_t index = VPN_TO_INDEX(vpn, level);
+            uint64_t span = LEVEL_SPAN(level);
+            uint64_t pte = path[level][index];
+            next = (vpn & ~(span - 1)) + span;
+            if (create) {
+                set_pte(path[level], index, NEW_VALID_PTE(ppn) | PTE_HUGE);
+                ppn += span;
+            } else {
+                set_pte(path[level], index, 0);
+            }
+            // Only freed once unlinked, for the sake of concurrent queries
+            if ((pte & PTE_VALID) && !(pte & PTE_HUGE)) {
+                pwc_invalidate_range(pt, vpn & ~(span - 1), span);
+                free_subtree(pte, level);
+            }
+        } else {
+            uint64_t *leaf = path[LAST_LEVEL];
+            next = vpn;
+            for (uint16_t index = VPN_TO_INDEX(vpn, LAST_LEVEL);
+                 index < NODE_ENTRIES && next < end; index++, next++) {
+                if (create) {
+                    set_pte(leaf, index, NEW_VALID_PTE(ppn + (next - vpn)));
+                } else {
+                    set_pte(leaf, index, 0);
+                }
+            }
+            if (create)
+                ppn += next - vpn;
+        }
+        if (next >= end || next < vpn) // Done, or wrapped around
+            break;
+        level = first_diverging_level(vpn, next);
+        if (!create)
+            reclaim_path(path, vpn, level, depth);
+        vpn = next;
+    }
+    if (!create)
+        reclaim_path(path, vpn, 0, depth);
+}
+
 void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
-    uint64_t *table = phys_to_virt(pt << 12);
-    uint64_t *terminal_pte = get_terminal_pte(table, vpn, ppn != NO_MAPPING);
-    if (!terminal_pte) // VPN is unmapped and we didn't create a new PTE for it.
+    update_range(pt, vpn, ppn, 1);
+}
+
+void page_table_update_range(uint64_t pt, uint64_t vpn_start,
+                             uint64_t ppn_start, uint64_t count) {
+    update_range(pt, vpn_start, ppn_start, count);
+}
+
+void page_table_unmap_range(uint64_t pt, uint64_t vpn_start, uint64_t count) {
+    update_range(pt, vpn_start, NO_MAPPING, count);
+}
+
+int page_table_update_sized(uint64_t pt, uint64_t vpn, uint64_t ppn,
+                            enum page_size size) {
+    if (size < PAGE_SIZE_4K || size > PAGE_SIZE_1G)
+        return -1;
+    // A 2 MiB page spans 9 bits of VPN, and a 1 GiB page 18: either must be
+    // covered by a whole PTE at some level
+    int bits = 9 * size;
+    int level = LAST_LEVEL - bits / PT_BITS_PER_LEVEL;
+    if (bits % PT_BITS_PER_LEVEL != 0 || level < HUGE_MIN_LEVEL)
+        return -1;
+    uint64_t span = LEVEL_SPAN(level);
+    if (vpn % span != 0 || (ppn != NO_MAPPING && ppn % span != 0))
+        return -1;
+    update_range(pt, vpn, ppn, span);
+    return 0;
+}
+
+/**
+ * Creates a copy of the page table `pt`, returning the root of the copy. Only
+ * the root is copied: every node below it is shared by both tables, and a
+ * table only gets its own copy of a shared node once it updates a PTE under
+ * it.
+ * */
+uint64_t page_table_clone(uint64_t pt) {
+    uint64_t frame;
+    copy_node(phys_to_virt(pt << 12), 0, &frame);
+    return frame;
+}
+
+/**
+ * Frees every node of the page table `pt`, including its root, its TLB and
+ * its page-walk cache.
+ * Nodes still shared with other tables are left to them.
+ * */
+void page_table_destroy(uint64_t pt) {
+    uint64_t *root = phys_to_virt(pt << 12);
+    page_table_tlb_disable(pt);
+    page_table_walk_cache_disable(pt);
+    for (int i = 0; i < NODE_ENTRIES; i++) {
+        // With 3 levels or fewer, root PTEs may map huge pages
+        if ((root[i] & PTE_VALID) && !(root[i] & PTE_HUGE))
+            free_subtree(root[i], 0);
+    }
+    release_frame(pt);
+}
+
+struct extent_walk {
+    uint64_t lo;
+    uint64_t hi;
+    page_table_extent_fn callback;
+    void *arg;
+    // The extent being built, not yet passed to `callback`
+    uint64_t vpn;
+    uint64_t ppn;
+    uint64_t count;
+    int stopped;
+};
+
+/**
+ * Adds the mapping of `count` pages from `vpn` to `ppn` to the pending
+ * extent if it continues it, and otherwise reports the pending extent and
+ * starts a new one.
+ * */
+static void add_extent(struct extent_walk *walk, uint64_t vpn, uint64_t ppn,
+                       uint64_t count) {
+    if (walk->count && walk->vpn + walk->count == vpn &&
+        walk->ppn + walk->count == ppn) {
+        walk->count += count;
         return;
-    if (ppn == NO_MAPPING) {
-        *terminal_pte = 0;
-    } else {
-        *terminal_pte = NEW_VALID_PTE(ppn);
+    }
+    if (walk->count &&
+        walk->callback(walk->vpn, walk->ppn, walk->count, walk->arg)) {
+        walk->stopped = 1;
+        return;
+    }
+    walk->vpn = vpn;
+    walk->ppn = ppn;
+    walk->count = count;
+}
+
+/**
+ * Visits the valid PTEs of `node`, a node at `level` whose first PTE maps
+ * `base`, that map anything inside the walk's range. Invalid PTEs are
+ * skipped without descending, and the scan of a node stops once all its
+ * valid PTEs were seen.
+ * */
+static void for_each_in_node(struct extent_walk *walk, uint64_t *node,
+                             int level, uint64_t base) {
+    uint64_t span = LEVEL_SPAN(level);
+    uint64_t remaining = NODE_POPULATION(node);
+    int first = walk->lo > base ? (walk->lo - base) / span : 0;
+    for (int i = first; i < NODE_ENTRIES && remaining && !walk->stopped; i++) {
+        uint64_t pte = node[i];
+        uint64_t vpn = base + i * span;
+        if (vpn >= walk->hi)
+            break;
+        if (!(pte & PTE_VALID))
+            continue;
+        remaining--;
+        if (level < LAST_LEVEL && !(pte & PTE_HUGE)) {
+            for_each_in_node(walk, phys_to_virt(pte & PTE_ADDR_MASK), level + 1,
+                             vpn);
+            continue;
+        }
+        // Clip huge pages to the range
+        uint64_t start = vpn < walk->lo ? walk->lo : vpn;
+        uint64_t end = vpn + span > walk->hi ? walk->hi : vpn + span;
+        add_extent(walk, start, (pte >> 12) + (start - vpn), end - start);
     }
 }
 
+/**
+ * Calls `callback` for every extent of mappings in `[vpn_lo, vpn_hi)`, in
+ * order of VPN: every run of consecutive VPNs mapped to consecutive PPNs is
+ * reported as one extent, whatever the page sizes and nodes it spans. Stops
+ * early once `callback` returns nonzero. Runs in time proportional to the
+ * number of nodes holding mappings in the range.
+ * */
+void page_table_for_each(uint64_t pt, uint64_t vpn_lo, uint64_t vpn_hi,
+                         page_table_extent_fn callback, void *arg) {
+    struct extent_walk walk = {vpn_lo, vpn_hi, callback, arg, 0, 0, 0, 0};
+    if (vpn_lo >= vpn_hi)
+        return;
+    for_each_in_node(&walk, phys_to_virt(pt << 12), 0, 0);
+    if (walk.count && !walk.stopped)
+        callback(walk.vpn, walk.ppn, walk.count, arg);
+}
+
 uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
-    uint64_t *table = phys_to_virt(pt << 12);
-    uint64_t *terminal_pte = get_terminal_pte(table, vpn, 0);
-    if (!terminal_pte || !(*terminal_pte & 0x1))
+    struct tlb *tlb = find_tlb(pt);
+    if (tlb) {
+        struct tlb_entry *entry = tlb_lookup(tlb, vpn);
+        if (entry) {
+            tlb->hits++;
+            return entry->ppn;
+        }
+        tlb->misses++;
+    }
+    int level = LAST_LEVEL;
+    uint64_t *terminal_pte;
+    struct pwc *pwc = find_pwc(pt);
+    uint64_t *leaf = pwc ? pwc_lookup(pwc, vpn) : NULL;
+    int visited;
+    if (leaf) {
+        terminal_pte = &leaf[VPN_TO_INDEX(vpn, LAST_LEVEL)];
+        visited = 1;
+    } else {
+        uint64_t *table = phys_to_virt(pt << 12);
+        terminal_pte = get_terminal_pte(table, vpn, &level);
+        visited = level + 1;
+        if (terminal_pte && level == LAST_LEVEL && pwc)
+            pwc_insert(pwc, vpn, terminal_pte - VPN_TO_INDEX(vpn, LAST_LEVEL));
+    }
+    if (walk_stats_enabled) {
+        walks++;
+        levels_walked += visited;
+    }
+    if (!terminal_pte || !(*terminal_pte & PTE_VALID))
         return NO_MAPPING;
-    return (*terminal_pte) >> 12;
+    uint64_t ppn = ((*terminal_pte) >> 12) + (vpn & (LEVEL_SPAN(level) - 1));
+    if (tlb)
+        tlb_insert(tlb, vpn, ppn);
+    return ppn;
+}
+
+/**
+ * Same as `page_table_update`, but safe to call while other threads run
+ * `page_table_query_concurrent` on the same table. Updates are serialized
+ * among themselves, and the nodes they unlink are only freed once no query
+ * can still be walking them.
+ * */
+void page_table_update_concurrent(uint64_t pt, uint64_t vpn, uint64_t ppn) {
+    pthread_mutex_lock(&writer_lock);
+    defer_frees = 1;
+    update_range(pt, vpn, ppn, 1);
+    defer_frees = 0;
+    epoch_collect();
+    pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * Same as `page_table_query`, but safe to call concurrently with
+ * `page_table_update_concurrent`. The walk never retries, and never blocks
+ * (while no more than `MAX_READERS` live threads query): each PTE is read
+ * once with an acquire load. Bypasses the TLB, which isn't thread-safe.
+ * */
+uint64_t page_table_query_concurrent(uint64_t pt, uint64_t vpn) {
+    uint64_t *table = phys_to_virt(pt << 12);
+    uint64_t pte = 0;
+    uint64_t ppn = NO_MAPPING;
+    int level;
+    epoch_enter();
+    UNROLL_LEVELS
+    for (level = 0; level < PT_LEVELS; level++) {
+        pte = LOAD_PTE(&table[VPN_TO_INDEX(vpn, level)]);
+        if (!(pte & PTE_VALID) || (pte & PTE_HUGE) || level == LAST_LEVEL)
+            break;
+        table = phys_to_virt(pte & PTE_ADDR_MASK);
+    }
+    if (pte & PTE_VALID)
+        ppn = (pte >> 12) + (vpn & (LEVEL_SPAN(level) - 1));
+    epoch_exit();
+    return ppn;
+}
+
+#define BATCH_GROUP 16
+
+/**
+ * Translates sorted VPNs, keeping the path of the previous walk: each walk
+ * resumes from the level where its VPN diverges from the previous one, so
+ * VPNs sharing a prefix only walk the shared part once. The first PTE of the
+ * next walk is prefetched while the current one finishes. Returns the
+ * number of PTEs read.
+ * */
+static uint64_t query_sorted(uint64_t pt, const uint64_t *vpns,
+                             uint64_t *ppns, size_t n) {
+    uint64_t *path[PT_LEVELS];
+    uint64_t visited = 0;
+    int level = 0; // The walk of the next VPN resumes from `path[level]`
+    path[0] = phys_to_virt(pt << 12);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t vpn = vpns[i];
+        uint64_t pte;
+        for (;; level++) {
+            pte = path[level][VPN_TO_INDEX(vpn, level)];
+            visited++;
+            if (!(pte & PTE_VALID) || (pte & PTE_HUGE) || level == LAST_LEVEL)
+                break;
+            path[level + 1] = phys_to_virt(pte & PTE_ADDR_MASK);
+        }
+        if (pte & PTE_VALID) {
+            ppns[i] = (pte >> 12) + (vpn & (LEVEL_SPAN(level) - 1));
+        } else {
+            ppns[i] = NO_MAPPING;
+        }
+        if (i + 1 < n) {
+            int diverging = first_diverging_level(vpn, vpns[i + 1]);
+            if (diverging < level)
+                level = diverging;
+            __builtin_prefetch(&path[level][VPN_TO_INDEX(vpns[i + 1], level)]);
+        }
+    }
+    return visited;
+}
+
+/**
+ * Translates VPNs in any order, in groups of `BATCH_GROUP` walked one level
+ * at a time: the PTEs the whole group needs at the next level are prefetched
+ * before any of them is read, so the walks' cache misses overlap instead of
+ * each walk waiting on its own chain of them. Returns the number of PTEs
+ * read.
+ * */
+static uint64_t query_interleaved(uint64_t pt, const uint64_t *vpns,
+                                  uint64_t *ppns, size_t n) {
+    uint64_t *root = phys_to_virt(pt << 12);
+    uint64_t visited = 0;
+    for (size_t base = 0; base < n; base += BATCH_GROUP) {
+        uint64_t *nodes[BATCH_GROUP];
+        size_t group = n - base < BATCH_GROUP ? n - base : BATCH_GROUP;
+        size_t active = group;
+        for (size_t i = 0; i < group; i++) {
+            nodes[i] = root;
+        }
+        UNROLL_LEVELS
+        for (int level = 0; level < PT_LEVELS && active; level++) {
+            for (size_t i = 0; i < group; i++) {
+                if (nodes[i])
+                    __builtin_prefetch(
+                        &nodes[i][VPN_TO_INDEX(vpns[base + i], level)]);
+            }
+            for (size_t i = 0; i < group; i++) {
+                if (!nodes[i])
+                    continue;
+                uint64_t vpn = vpns[base + i];
+                uint64_t pte = nodes[i][VPN_TO_INDEX(vpn, level)];
+                visited++;
+                if ((pte & PTE_VALID) && !(pte & PTE_HUGE) && level < LAST_LEVEL) {
+                    nodes[i] = phys_to_virt(pte & PTE_ADDR_MASK);
+                    continue;
+                }
+                if (pte & PTE_VALID) {
+                    ppns[base + i] =
+                        (pte >> 12) + (vpn & (LEVEL_SPAN(level) - 1));
+                } else {
+                    ppns[base + i] = NO_MAPPING;
+                }
+                nodes[i] = NULL;
+                active--;
+            }
+        }
+    }
+    return visited;
+}
+
+/**
+ * Translates `n` VPNs at once, into `ppns` (in the same order as `vpns`).
+ * Sorted batches share the walks of common prefixes, and any other batch has
+ * its walks interleaved so their cache misses overlap. Sorting unsorted
+ * batches first doesn't pay off: scattering the results back costs more than
+ * the shared walks save. Bypasses the TLB and the page-walk cache.
+ * */
+void page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t *ppns,
+                            size_t n) {
+    size_t i = 1;
+    while (i < n && vpns[i - 1] <= vpns[i]) {
+        i++;
+    }
+    uint64_t visited;
+    if (i >= n) {
+        visited = query_sorted(pt, vpns, ppns, n);
+    } else {
+        visited = query_interleaved(pt, vpns, ppns, n);
+    }
+    if (walk_stats_enabled) {
+        walks += n;
+        levels_walked += visited;
+    }
 }
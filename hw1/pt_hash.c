@@ -0,0 +1,287 @@
+/**
+ * A hashed page table, an alternative to the radix tree in pt.c for sparse
+ * address spaces. Build it in place of pt.c, with `-DPT_BACKEND_HASH` so the
+ * harness only runs what this backend supports:
+ *
+ *     gcc -O2 -DPT_BACKEND_HASH os.c pt_hash.c
+ *
+ * Mappings live in an open-addressing table keyed by VPN. Every bucket is a
+ * cache line of VPNs, followed by a line of the PPNs they map to, and all the
+ * VPNs of a bucket are compared against the one looked up at once with SIMD.
+ * Collisions probe the next bucket. Buckets are carved out of page frames, so
+ * the table is accounted for like radix nodes are.
+ * */
+#include "os.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define BUCKET_SLOTS 8
+#define BUCKETS_PER_FRAME (4096 / sizeof(struct bucket))
+
+// Neither is a valid VPN, since VPNs fit in `PT_VPN_BITS` bits
+#define EMPTY_KEY (~0ULL)
+#define TOMBSTONE_KEY (~1ULL)
+
+#define BATCH_PREFETCH 8
+
+struct bucket {
+    uint64_t vpns[BUCKET_SLOTS]; // `EMPTY_KEY` or `TOMBSTONE_KEY` if unused
+    uint64_t ppns[BUCKET_SLOTS];
+};
+
+struct table_frame {
+    struct bucket *buckets;
+    uint64_t ppn;
+};
+
+/**
+ * The table's header, kept in the root frame `pt`. A fresh root frame is
+ * zeroed, which makes it an empty table with no buckets.
+ * */
+struct hash_table {
+    struct table_frame *frames;
+    uint64_t nbuckets; // A power of 2 multiple of `BUCKETS_PER_FRAME`, or 0
+    int shift;         // 64 - log2(nbuckets)
+    uint64_t used;
+    uint64_t tombstones;
+};
+
+static struct hash_table *get_table(uint64_t pt) {
+    return phys_to_virt(pt << 12);
+}
+
+static inline struct bucket *get_bucket(const struct hash_table *table,
+                                        uint64_t index) {
+    return &table->frames[index / BUCKETS_PER_FRAME]
+                .buckets[index % BUCKETS_PER_FRAME];
+}
+
+/**
+ * Returns the first bucket to probe for `vpn`. Fibonacci hashing spreads
+ * consecutive VPNs over the whole table.
+ * */
+static inline uint64_t home_bucket(const struct hash_table *table,
+                                   uint64_t vpn) {
+    return (vpn * 0x9e3779b97f4a7c15ULL) >> table->shift;
+}
+
+/**
+ * Returns a bitmask of the slots of `bucket` holding `key`.
+ * */
+static inline unsigned match_slots(const struct bucket *bucket, uint64_t key) {
+#if defined(__AVX2__)
+    __m256i needle = _mm256_set1_epi64x(key);
+    const __m256i *vpns = (const __m256i *)bucket->vpns;
+    __m256i lo = _mm256_cmpeq_epi64(_mm256_load_si256(vpns), needle);
+    __m256i hi = _mm256_cmpeq_epi64(_mm256_load_si256(vpns + 1), needle);
+    return _mm256_movemask_pd(_mm256_castsi256_pd(lo)) |
+           _mm256_movemask_pd(_mm256_castsi256_pd(hi)) << 4;
+#elif defined(__SSE2__)
+    // SSE2 has no 64-bit compare: a slot matches if both its halves do
+    __m128i needle = _mm_set1_epi64x(key);
+    const __m128i *vpns = (const __m128i *)bucket->vpns;
+    unsigned mask = 0;
+    for (int i = 0; i < BUCKET_SLOTS / 2; i++) {
+        __m128i eq = _mm_cmpeq_epi32(_mm_load_si128(vpns + i), needle);
+        eq = _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+        mask |= _mm_movemask_pd(_mm_castsi128_pd(eq)) << (2 * i);
+    }
+    return mask;
+#else
+    unsigned mask = 0;
+    for (int i = 0; i < BUCKET_SLOTS; i++) {
+        mask |= (unsigned)(bucket->vpns[i] == key) << i;
+    }
+    return mask;
+#endif
+}
+
+/**
+ * Returns the slot of `vpn`, and sets `*found` to its bucket, or returns -1
+ * if `vpn` isn't mapped. A bucket with an empty slot ends the probe: nothing
+ * was ever pushed past it.
+ * */
+static int find_slot(const struct hash_table *table, uint64_t vpn,
+                     struct bucket **found) {
+    uint64_t index = home_bucket(table, vpn);
+    for (;;) {
+        struct bucket *bucket = get_bucket(table, index);
+        unsigned match = match_slots(bucket, vpn);
+        if (match) {
+            *found = bucket;
+            return __builtin_ctz(match);
+        }
+        if (match_slots(bucket, EMPTY_KEY))
+            return -1;
+        index = (index + 1) & (table->nbuckets - 1);
+    }
+}
+
+/**
+ * Puts a mapping of `vpn`, which must not be in the table, in the first
+ * unused slot on its probe sequence.
+ * */
+static void insert_new(struct hash_table *table, uint64_t vpn, uint64_t ppn) {
+    uint64_t index = home_bucket(table, vpn);
+    for (;;) {
+        struct bucket *bucket = get_bucket(table, index);
+        unsigned unused = match_slots(bucket, EMPTY_KEY) |
+                          match_slots(bucket, TOMBSTONE_KEY);
+        if (unused) {
+            int slot = __builtin_ctz(unused);
+            if (bucket->vpns[slot] == TOMBSTONE_KEY)
+                table->tombstones--;
+            bucket->vpns[slot] = vpn;
+            bucket->ppns[slot] = ppn;
+            table->used++;
+            return;
+        }
+        index = (index + 1) & (table->nbuckets - 1);
+    }
+}
+
+static void free_frames(struct table_frame *frames, uint64_t nframes) {
+    for (uint64_t i = 0; i < nframes; i++) {
+        free_page_frame(frames[i].ppn);
+    }
+    free(frames);
+}
+
+/**
+ * Moves every mapping into a fresh table of `nbuckets` buckets, dropping the
+ * tombstones, and frees the old one. Returns -1, leaving the table as it
+ * was, if the new table's frame list can't be allocated.
+ * */
+static int rehash(struct hash_table *table, uint64_t nbuckets) {
+    uint64_t nframes = nbuckets / BUCKETS_PER_FRAME;
+    struct table_frame *frames = malloc(nframes * sizeof(*frames));
+    if (!frames)
+        return -1;
+    for (uint64_t i = 0; i < nframes; i++) {
+        frames[i].ppn = alloc_page_frame();
+        frames[i].buckets = phys_to_virt(frames[i].ppn << 12);
+        memset(frames[i].buckets, 0xff, 4096);
+    }
+
+    struct hash_table old = *table;
+    table->frames = frames;
+    table->nbuckets = nbuckets;
+    table->shift = 64 - __builtin_ctzll(nbuckets);
+    table->used = 0;
+    table->tombstones = 0;
+    for (uint64_t i = 0; i < old.nbuckets; i++) {
+        struct bucket *bucket = get_bucket(&old, i);
+        for (int slot = 0; slot < BUCKET_SLOTS; slot++) {
+            if (bucket->vpns[slot] < TOMBSTONE_KEY)
+                insert_new(table, bucket->vpns[slot], bucket->ppns[slot]);
+        }
+    }
+    if (old.frames)
+        free_frames(old.frames, old.nbuckets / BUCKETS_PER_FRAME);
+    return 0;
+}
+
+/**
+ * Frees the table's buckets, leaving it empty.
+ * */
+static void clear(struct hash_table *table) {
+    if (table->frames)
+        free_frames(table->frames, table->nbuckets / BUCKETS_PER_FRAME);
+    memset(table, 0, sizeof(*table));
+}
+
+void page_table_update(uint64_t pt, uint64_t vpn, uint64_t ppn) {
+    struct hash_table *table = get_table(pt);
+    struct bucket *bucket;
+    int slot = table->nbuckets ? find_slot(table, vpn, &bucket) : -1;
+
+    if (ppn == NO_MAPPING) {
+        if (slot < 0)
+            return;
+        // Only a full bucket can have had other VPNs probe past it
+        if (match_slots(bucket, EMPTY_KEY)) {
+            bucket->vpns[slot] = EMPTY_KEY;
+        } else {
+            bucket->vpns[slot] = TOMBSTONE_KEY;
+            table->tombstones++;
+        }
+        if (--table->used == 0)
+            clear(table);
+        return;
+    }
+    if (slot >= 0) {
+        bucket->ppns[slot] = ppn;
+        return;
+    }
+
+    // Keep the load, tombstones included, under 3/4. Grow if that's because
+    // of live mappings, otherwise just sweep the tombstones.
+    uint64_t capacity = table->nbuckets * BUCKET_SLOTS;
+    if ((table->used + table->tombstones + 1) * 4 > capacity * 3) {
+        uint64_t nbuckets = table->nbuckets;
+        if (nbuckets == 0) {
+            nbuckets = BUCKETS_PER_FRAME;
+        } else if ((table->used + 1) * 2 > capacity) {
+            nbuckets *= 2;
+        }
+        // Without a new table, use up the slack, but always leave an empty
+        // slot for probes to stop at
+        if (rehash(table, nbuckets) != 0 &&
+            table->used + table->tombstones + 1 >= capacity)
+            return;
+    }
+    insert_new(table, vpn, ppn);
+}
+
+uint64_t page_table_query(uint64_t pt, uint64_t vpn) {
+    struct hash_table *table = get_table(pt);
+    struct bucket *bucket;
+    if (!table->nbuckets)
+        return NO_MAPPING;
+    int slot = find_slot(table, vpn, &bucket);
+    return slot < 0 ? NO_MAPPING : bucket->ppns[slot];
+}
+
+void page_table_update_range(uint64_t pt, uint64_t vpn_start,
+                             uint64_t ppn_start, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        page_table_update(pt, vpn_start + i, ppn_start + i);
+    }
+}
+
+void page_table_unmap_range(uint64_t pt, uint64_t vpn_start, uint64_t count) {
+    for (uint64_t i = 0; i < count; i++) {
+        page_table_update(pt, vpn_start + i, NO_MAPPING);
+    }
+}
+
+/**
+ * Same as `page_table_query` for each VPN. Lookups don't depend on each
+ * other, so the home bucket of a VPN a few places ahead is prefetched while
+ * the current one is looked up.
+ * */
+void page_table_query_batch(uint64_t pt, const uint64_t *vpns, uint64_t *ppns,
+                            size_t n) {
+    struct hash_table *table = get_table(pt);
+    for (size_t i = 0; i < n; i++) {
+        if (table->nbuckets && i + BATCH_PREFETCH < n)
+            __builtin_prefetch(get_bucket(
+                table, home_bucket(table, vpns[i + BATCH_PREFETCH])));
+        ppns[i] = page_table_query(pt, vpns[i]);
+    }
+}
+
+/**
+ * Frees the table's buckets and its root frame.
+ * */
+void page_table_destroy(uint64_t pt) {
+    clear(get_table(pt));
+    free_page_frame(pt);
+}
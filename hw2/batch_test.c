@@ -0,0 +1,80 @@
+/**
+ * Checks that in batch mode, builtins that change the shell itself affect the
+ * jobs after them. Runs the shell built from shell.c on scripts in a fresh
+ * directory under /tmp:
+ *
+ *     gcc shell.c myshell.c tokenize.c -o shell
+ *     gcc batch_test.c -o batch_test
+ *     ./batch_test ./shell
+ * */
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+char shell[PATH_MAX];
+
+/**
+ * Runs `script` with `shell -j 3`, and returns what it wrote to stdout,
+ * which the caller frees.
+ * */
+char *run_batch(const char *script) {
+    FILE *file = fopen("script", "w");
+    assert(file);
+    fputs(script, file);
+    fclose(file);
+
+    char command[PATH_MAX + 32];
+    snprintf(command, sizeof(command), "%s -j 3 script", shell);
+    FILE *out = popen(command, "r");
+    assert(out);
+    char *output = calloc(1, 4096);
+    fread(output, 1, 4095, out);
+    assert(pclose(out) == 0);
+    unlink("script");
+    return output;
+}
+
+void assert_output(const char *script, const char *expected) {
+    char *output = run_batch(script);
+    if (strcmp(output, expected) != 0) {
+        fprintf(stderr, "%s: got \"%s\", expected \"%s\"\n", script, output,
+                expected);
+        assert(0);
+    }
+    free(output);
+}
+
+void test_cd(const char *dir) {
+    char expected[PATH_MAX + 2];
+    snprintf(expected, sizeof(expected), "%s/sub\n", dir);
+    assert_output("cd sub\npwd\n", expected);
+    assert_output("cd sub ; pwd\n", expected);
+}
+
+void test_exit() {
+    assert_output("echo a\nexit\necho b\n", "a\n");
+    assert_output("echo a ; exit & echo b\n", "a\n");
+}
+
+int main(int argc, char **argv) {
+    assert(realpath(argc > 1 ? argv[1] : "shell", shell));
+    char dir[] = "/tmp/batch_test.XXXXXX";
+    assert(mkdtemp(dir) && chdir(dir) == 0);
+    assert(mkdir("sub", 0755) == 0);
+    char cwd[PATH_MAX];
+    assert(getcwd(cwd, sizeof(cwd)));
+
+    test_cd(cwd);
+    test_exit();
+
+    rmdir("sub");
+    chdir("/");
+    rmdir(dir);
+    printf("PASSED\n");
+    return 0;
+}
@@ -0,0 +1,53 @@
+/**
+ * Commands launched per second by `process_arglist`, with either launch
+ * engine, while the shell's process holds a large heap it has touched. Build
+ * it with the shell in place of shell.c:
+ *
+ *     gcc -O2 launch_bench.c myshell.c -o launch_bench
+ *     ./launch_bench [heap MiB] [commands]
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+int prepare(void);
+int process_arglist(int count, char **arglist);
+
+double now_seconds(void);
+
+extern int launch_with_fork;
+
+double launches_per_second(int commands) {
+    double start = now_seconds();
+    for (int i = 0; i < commands; i++) {
+        // A path, since plain `true` is now a shell builtin
+        char true_word[] = "/bin/true";
+        char *arglist[] = {true_word, NULL};
+        process_arglist(1, arglist);
+    }
+    return commands / (now_seconds() - start);
+}
+
+int main(int argc, char *argv[]) {
+    size_t heap_mib = argc > 1 ? atoi(argv[1]) : 1024;
+    int commands = argc > 2 ? atoi(argv[2]) : 1000;
+    char *heap = malloc(heap_mib << 20);
+    if (!heap) {
+        perror("launch_bench");
+        return 1;
+    }
+    // Touch every page, so they're all mapped when the shell forks
+    memset(heap, 1, heap_mib << 20);
+
+    if (prepare() != 0) {
+        return 1;
+    }
+    launch_with_fork = 1;
+    printf("%zu MiB heap, fork:        %8.0f commands/s\n", heap_mib,
+           launches_per_second(commands));
+    launch_with_fork = 0;
+    printf("%zu MiB heap, posix_spawn: %8.0f commands/s\n", heap_mib,
+           launches_per_second(commands));
+    free(heap);
+    return 0;
+}
@@ -1,31 +1,274 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <wait.h>
 
-int child1 = -1;
-int child2 = -1;
+/**
+ * A foreground child of the command being run, with when it was started and
+ * how long starting it took.
+ * */
+struct child {
+    pid_t pid;
+    double started;
+    double launch_seconds;
+    char *command; // The stage it runs, only kept while profiling
+};
+
+// The foreground children of the command being run, in the order they were
+// started. Has room for one child per word of the command.
+struct child *children = NULL;
+int nchildren = 0;
+
+// Size to set the pipes between pipeline stages to, with `F_SETPIPE_SZ`.
+// Taken from the `MYSHELL_PIPE_SIZE` environment variable; 0 keeps the
+// default.
+int pipe_size = 0;
+
+// Launch commands with fork and exec instead of posix_spawn. Set by
+// `MYSHELL_LAUNCH=fork`, to compare the two.
+int launch_with_fork = 0;
+
+/**
+ * A background (`&`) job. Once it exits, the SIGCHLD handler reaps it and
+ * fills in its wait status and resource usage.
+ * */
+struct job {
+    int id;
+    pid_t pid;
+    char *command;
+    int running;
+    int status;
+    struct rusage usage;
+    double started;
+    double launch_seconds;
+    double ended;
+};
+
+// The background jobs that haven't been reported as done yet, by `jobs`,
+// `wait`, or before the next command. Only changed with SIGCHLD blocked, since
+// the handler walks it.
+struct job *jobs = NULL;
+int njobs = 0;
+int jobs_capacity = 0;
+
+volatile sig_atomic_t interrupted = 0;
+
+// The signal mask commands start with: the shell's mask from before it
+// blocked anything, not SIGCHLD blocked as it is while starting a job.
+sigset_t child_sigmask;
+
+#define PROFILE_SLOWEST 5
+#define PROFILE_COMMAND_LENGTH 64
+
+/**
+ * Totals over every command profiled this session, and the slowest ones.
+ * Kept in a shared mapping, so the commands batch mode's workers run count
+ * towards the summary the shell prints. The workers update it concurrently,
+ * under `lock`.
+ * */
+struct profile_summary {
+    char lock;
+    long commands;
+    double wall_seconds;
+    double launch_seconds;
+    double user_seconds;
+    double system_seconds;
+    long max_rss_kib;
+    long voluntary_switches;
+    long involuntary_switches;
+    struct {
+        double wall_seconds;
+        char command[PROFILE_COMMAND_LENGTH];
+    } slowest[PROFILE_SLOWEST];
+};
+
+// Where every command gets a CSV row with its timing and resource usage, or
+// NULL when not profiling. Set by `MYSHELL_PROFILE=file` or `profile file`.
+FILE *profile_log = NULL;
+struct profile_summary *profile_summary = NULL;
+
+#define PATH_CACHE_BUCKETS 64
+// What execvp searches when PATH isn't set
+#define DEFAULT_PATH "/bin:/usr/bin"
+
+/**
+ * A command found by searching PATH, like in bash's `hash` table.
+ * */
+struct path_entry {
+    struct path_entry *next;
+    char *name;
+    char *path;
+    unsigned hits;
+};
+
+// Commands resolved under `cached_path_var`, which is the PATH they were
+// found with. An inotify watch on every PATH directory (`path_watch_fd`)
+// flushes them when a directory's contents change.
+struct path_entry *path_cache[PATH_CACHE_BUCKETS];
+char *cached_path_var = NULL;
+int path_watch_fd = -1;
+
+double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
 
 void sigint_handler(int signal) {
-    if (child1 > 0) {
-        kill(child1, SIGINT);
-    }
-    if (child2 > 0) {
-        kill(child2, SIGINT);
+    for (int i = 0; i < nchildren; i++) {
+        kill(children[i].pid, SIGINT);
     }
+    interrupted = 1;
     // So `^C` doesn't show up at the start of the next line, but causes a
     // linebreak instead
     printf("\n");
 }
 
+/**
+ * Reap the background jobs that exited. Foreground children are left to the
+ * `waitpid` in `process_arglist`, so only job pids are waited for.
+ * */
+void sigchld_handler(int signal) {
+    int saved_errno = errno;
+    for (int i = 0; i < njobs; i++) {
+        if (jobs[i].running && wait4(jobs[i].pid, &jobs[i].status, WNOHANG,
+                                     &jobs[i].usage) > 0) {
+            jobs[i].running = 0;
+            jobs[i].ended = now_seconds();
+        }
+    }
+    errno = saved_errno;
+}
+
+void block_sigchld(sigset_t *old_mask) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, old_mask);
+}
+
+double timeval_seconds(struct timeval tv) {
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/**
+ * Start appending a row for every command to the CSV file `path`, writing
+ * the header first if it's empty.
+ * */
+int start_profiling(const char *path) {
+    // Close-on-exec, so the commands it profiles don't inherit it
+    FILE *log = fopen(path, "ae");
+    if (!log) {
+        perror(path);
+        return -1;
+    }
+    if (profile_log) {
+        fclose(profile_log);
+    }
+    profile_log = log;
+    struct stat st;
+    if (fstat(fileno(log), &st) == 0 && st.st_size == 0) {
+        fprintf(log, "command,pid,status,wall_ms,launch_ms,user_ms,sys_ms,"
+                     "max_rss_kib,voluntary_switches,involuntary_switches\n");
+        fflush(log);
+    }
+    if (!profile_summary) {
+        void *shared = mmap(NULL, sizeof(*profile_summary),
+                            PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (shared == MAP_FAILED) {
+            perror("mmap");
+        } else {
+            profile_summary = shared;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Add a command to the totals, and to the slowest ones if it's among them.
+ * */
+void add_to_summary(const char *command, double wall_seconds,
+                    double launch_seconds, const struct rusage *usage) {
+    struct profile_summary *summary = profile_summary;
+    if (!summary) {
+        return;
+    }
+    while (__atomic_test_and_set(&summary->lock, __ATOMIC_ACQUIRE)) {
+    }
+    summary->commands++;
+    summary->wall_seconds += wall_seconds;
+    summary->launch_seconds += launch_seconds;
+    summary->user_seconds += timeval_seconds(usage->ru_utime);
+    summary->system_seconds += timeval_seconds(usage->ru_stime);
+    if (usage->ru_maxrss > summary->max_rss_kib) {
+        summary->max_rss_kib = usage->ru_maxrss;
+    }
+    summary->voluntary_switches += usage->ru_nvcsw;
+    summary->involuntary_switches += usage->ru_nivcsw;
+
+    // Insert it into the slowest, which are sorted slowest first
+    int i = PROFILE_SLOWEST;
+    while (i > 0 && wall_seconds > summary->slowest[i - 1].wall_seconds) {
+        if (i < PROFILE_SLOWEST) {
+            summary->slowest[i] = summary->slowest[i - 1];
+        }
+        i--;
+    }
+    if (i < PROFILE_SLOWEST) {
+        summary->slowest[i].wall_seconds = wall_seconds;
+        snprintf(summary->slowest[i].command, PROFILE_COMMAND_LENGTH, "%s",
+                 command ? command : "");
+    }
+    __atomic_clear(&summary->lock, __ATOMIC_RELEASE);
+}
+
+/**
+ * Log the timing and resource usage of a command that exited with `status`,
+ * as reported by wait4. `launch_seconds` is how long starting it took: with
+ * posix_spawn that includes the exec, with fork just the fork.
+ * */
+void record_profile(const char *command, pid_t pid, int status,
+                    double wall_seconds, double launch_seconds,
+                    const struct rusage *usage) {
+    if (!profile_log) {
+        return;
+    }
+    // Quoted, with quotes doubled, as CSV has it
+    fputc('"', profile_log);
+    for (const char *c = command ? command : ""; *c; c++) {
+        if (*c == '"') {
+            fputc('"', profile_log);
+        }
+        fputc(*c, profile_log);
+    }
+    fprintf(profile_log, "\",%d,%d,%.3f,%.3f,%.3f,%.3f,%ld,%ld,%ld\n", pid,
+            WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status),
+            wall_seconds * 1000, launch_seconds * 1000,
+            timeval_seconds(usage->ru_utime) * 1000,
+            timeval_seconds(usage->ru_stime) * 1000, usage->ru_maxrss,
+            usage->ru_nvcsw, usage->ru_nivcsw);
+    // Batch workers share the file, so rows are written out whole, and
+    // nothing is left buffered to be duplicated by the next fork
+    fflush(profile_log);
+    add_to_summary(command, wall_seconds, launch_seconds, usage);
+}
+
 int prepare() {
+    sigprocmask(SIG_SETMASK, NULL, &child_sigmask);
     struct sigaction sigint_action;
     memset(&sigint_action, 0, sizeof(sigint_action));
     sigint_action.sa_handler = sigint_handler;
@@ -33,143 +276,1032 @@ int prepare() {
     if (sigaction(SIGINT, &sigint_action, NULL) == -1) {
         perror("signal");
     }
-    if (signal(SIGCHLD, SIG_IGN) == SIG_ERR) {
+    struct sigaction sigchld_action;
+    memset(&sigchld_action, 0, sizeof(sigchld_action));
+    sigchld_action.sa_handler = sigchld_handler;
+    sigchld_action.sa_flags = SA_RESTART | SA_NOCLDSTOP;
+    if (sigaction(SIGCHLD, &sigchld_action, NULL) == -1) {
         perror("signal");
     }
+    char *size = getenv("MYSHELL_PIPE_SIZE");
+    if (size) {
+        pipe_size = atoi(size);
+    }
+    char *launch_engine = getenv("MYSHELL_LAUNCH");
+    if (launch_engine && strcmp(launch_engine, "fork") == 0) {
+        launch_with_fork = 1;
+    }
+    char *profile_path = getenv("MYSHELL_PROFILE");
+    if (profile_path) {
+        start_profiling(profile_path);
+    }
     return 0;
 }
 
+void checked_exec(const char *path, char **arglist) {
+    if (execv(path, arglist) == -1) {
+        perror("exec");
+        _exit(1);
+    }
+}
+
+unsigned hash_name(const char *name) {
+    unsigned hash = 5381;
+    while (*name) {
+        hash = hash * 33 + (unsigned char)*name++;
+    }
+    return hash;
+}
+
+void flush_path_cache() {
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        while (path_cache[i]) {
+            struct path_entry *entry = path_cache[i];
+            path_cache[i] = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+        }
+    }
+}
+
 /**
- * Find `word` in `wordlist`, and return the index of its first occurance.
- * Returns -1 if not found.
+ * Watch every directory of `path_var` for commands appearing, disappearing
+ * or changing. Without inotify, the cache is only flushed by PATH changes
+ * and `hash -r`.
  * */
-int find(int count, char **wordlist, char *word) {
-    for (int i = 0; i < count; i++) {
-        if (strcmp(wordlist[i], word) == 0) {
-            return i;
+void watch_path(const char *path_var) {
+    if (path_watch_fd >= 0) {
+        close(path_watch_fd);
+    }
+    path_watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (path_watch_fd < 0) {
+        return;
+    }
+    char *dirs = strdup(path_var);
+    char *save = NULL;
+    for (char *dir = dirs ? strtok_r(dirs, ":", &save) : NULL; dir;
+         dir = strtok_r(NULL, ":", &save)) {
+        inotify_add_watch(path_watch_fd, dir,
+                          IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                              IN_MOVED_TO | IN_ATTRIB);
+    }
+    free(dirs);
+}
+
+/**
+ * Flush the cache if PATH changed since it was filled, or if any of the
+ * watched directories did.
+ * */
+void check_path_cache(const char *path_var) {
+    if (!cached_path_var || strcmp(cached_path_var, path_var) != 0) {
+        flush_path_cache();
+        free(cached_path_var);
+        cached_path_var = strdup(path_var);
+        watch_path(path_var);
+        return;
+    }
+    char events[4096];
+    int changed = 0;
+    while (path_watch_fd >= 0 &&
+           read(path_watch_fd, events, sizeof(events)) > 0) {
+        changed = 1;
+    }
+    if (changed) {
+        flush_path_cache();
+    }
+}
+
+/**
+ * Search the directories of `path_var` for an executable `name`, the way
+ * execvp does. Returns its path, to be freed by the caller, or NULL.
+ * */
+char *search_path(const char *path_var, const char *name) {
+    const char *dir = path_var;
+    for (;;) {
+        const char *dir_end = strchrnul(dir, ':');
+        int dir_length = dir_end - dir;
+        char *path = malloc(dir_length + strlen(name) + 3);
+        if (!path) {
+            return NULL;
         }
+        // An empty entry means the current directory
+        sprintf(path, "%.*s/%s", dir_length ? dir_length : 1,
+                dir_length ? dir : ".", name);
+        struct stat st;
+        if (access(path, X_OK) == 0 && stat(path, &st) == 0 &&
+            S_ISREG(st.st_mode)) {
+            return path;
+        }
+        free(path);
+        if (!*dir_end) {
+            return NULL;
+        }
+        dir = dir_end + 1;
     }
-    return -1;
 }
 
-void checked_exec(char **arglist) {
-    if (execvp(arglist[0], arglist) == -1) {
-        perror("exec");
-        exit(1);
+/**
+ * Return the path of the command `name`: itself if it has a `/`, or the
+ * cached result of searching PATH for it. Returns NULL, with `errno` set, if
+ * it can't be found. Misses aren't cached, so a command is found as soon as
+ * it's installed.
+ * */
+const char *resolve_command(const char *name) {
+    if (strchr(name, '/')) {
+        return name;
+    }
+    const char *path_var = getenv("PATH");
+    if (!path_var) {
+        path_var = DEFAULT_PATH;
+    }
+    check_path_cache(path_var);
+
+    struct path_entry **bucket =
+        &path_cache[hash_name(name) % PATH_CACHE_BUCKETS];
+    for (struct path_entry *entry = *bucket; entry; entry = entry->next) {
+        if (strcmp(entry->name, name) == 0) {
+            entry->hits++;
+            return entry->path;
+        }
+    }
+    struct path_entry *entry = malloc(sizeof(*entry));
+    char *path = search_path(path_var, name);
+    if (!entry || !path) {
+        free(entry);
+        free(path);
+        errno = ENOENT;
+        return NULL;
     }
+    entry->name = strdup(name);
+    entry->path = path;
+    entry->hits = 1;
+    entry->next = *bucket;
+    *bucket = entry;
+    return path;
+}
+
+/**
+ * A redirection operator, and the fd it redirects to a file opened with
+ * `flags`.
+ * */
+struct redirection_op {
+    const char *word;
+    int fd;
+    int flags;
+};
+
+const struct redirection_op redirection_ops[] = {
+    {"<", STDIN_FILENO, O_RDONLY},
+    {">", STDOUT_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+    {">>", STDOUT_FILENO, O_WRONLY | O_CREAT | O_APPEND},
+    {"2>", STDERR_FILENO, O_WRONLY | O_CREAT | O_TRUNC},
+};
+
+#define NREDIRECTION_OPS (sizeof(redirection_ops) / sizeof(redirection_ops[0]))
+
+/**
+ * Whether `arglist[i]` is the operator `op`. A word that was quoted or
+ * escaped, per `quoted`, is never an operator, however it reads once
+ * unquoted. `quoted` may be NULL if no word was.
+ * */
+int is_op(char **arglist, const char *quoted, int i, const char *op) {
+    return !(quoted && quoted[i]) && strcmp(arglist[i], op) == 0;
 }
 
 /**
- * Run two binaries according to the arglists, and pipe between them (1 | 2).
+ * Whether `arglist[i]` is `|` or a redirection operator.
  * */
-int pipe_between(char **arglist1, char **arglist2) {
-    int pipefd[2];
-    if (pipe(pipefd) == -1) {
-        perror("pipe");
+int is_operator(char **arglist, const char *quoted, int i) {
+    if (is_op(arglist, quoted, i, "|")) {
         return 1;
     }
+    for (size_t j = 0; j < NREDIRECTION_OPS; j++) {
+        if (is_op(arglist, quoted, i, redirection_ops[j].word)) {
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    child1 = fork();
-    if (child1 < 0) {
-        perror("fork");
-        return 1;
+void close_redirections(int opened[3]) {
+    for (int fd = 0; fd < 3; fd++) {
+        if (opened[fd] != -1) {
+            close(opened[fd]);
+            opened[fd] = -1;
+        }
     }
-    if (child1 == 0) {
-        close(pipefd[0]);
-        dup2(pipefd[1], STDOUT_FILENO);
-        close(pipefd[1]);
-        checked_exec(arglist1);
-        // Should not return
+}
+
+/**
+ * Open the files `stage` redirects to, put their fds in `opened` by the fd
+ * they replace, and remove the redirections from `stage` (and `quoted`). A
+ * later redirection of the same fd replaces an earlier one. Returns -1, with
+ * nothing left open, if a file can't be opened.
+ * */
+int open_redirections(char **stage, char *quoted, int opened[3]) {
+    int kept = 0;
+    for (int i = 0; stage[i]; i++) {
+        const struct redirection_op *op = NULL;
+        for (size_t j = 0; j < NREDIRECTION_OPS && !op; j++) {
+            if (is_op(stage, quoted, i, redirection_ops[j].word)) {
+                op = &redirection_ops[j];
+            }
+        }
+        if (!op) {
+            if (quoted) {
+                quoted[kept] = quoted[i];
+            }
+            stage[kept++] = stage[i];
+            continue;
+        }
+        if (!stage[i + 1]) {
+            fprintf(stderr, "syntax error: missing file after %s\n", op->word);
+            close_redirections(opened);
+            return -1;
+        }
+        if (opened[op->fd] != -1) {
+            close(opened[op->fd]);
+        }
+        // Created with read / write for user, read for everyone else
+        opened[op->fd] =
+            open(stage[++i], op->flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (opened[op->fd] == -1) {
+            perror("file");
+            close_redirections(opened);
+            return -1;
+        }
     }
-    child2 = fork();
-    if (child2 < 0) {
-        perror("fork");
-        return 1;
+    stage[kept] = NULL;
+    return 0;
+}
+
+/**
+ * Whether `redirect[fd]` is an fd to close once it's in place, which it is
+ * unless it's one of the standard fds, or an earlier entry already closes it.
+ * */
+int closes_redirect(const int redirect[3], int fd) {
+    if (redirect[fd] <= STDERR_FILENO) {
+        return 0;
+    }
+    for (int i = 0; i < fd; i++) {
+        if (redirect[i] == redirect[fd]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * In a forked child, put the `redirect` fds in place and close the
+ * `close_fds` (-1 for none).
+ * */
+void redirect_child(const int redirect[3], const int close_fds[3]) {
+    for (int i = 0; i < 3; i++) {
+        if (close_fds[i] != -1) {
+            close(close_fds[i]);
+        }
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (redirect[fd] != -1) {
+            dup2(redirect[fd], fd);
+        }
     }
-    if (child2 == 0) {
-        close(pipefd[1]);
-        dup2(pipefd[0], STDIN_FILENO);
-        close(pipefd[0]);
-        checked_exec(arglist2);
+    for (int fd = 0; fd < 3; fd++) {
+        if (closes_redirect(redirect, fd)) {
+            close(redirect[fd]);
+        }
+    }
+}
+
+int is_pipe(int fd) {
+    struct stat st;
+    return fstat(fd, &st) == 0 && S_ISFIFO(st.st_mode);
+}
+
+// The most `tee` takes from its input at a time
+#define TEE_CHUNK (1 << 20)
+
+/**
+ * Move `length` bytes from the pipe `from` to `to`. Uses splice, unless `to`
+ * doesn't support it, in which case they're copied. Returns -1 on error.
+ * */
+int splice_all(int from, int to, size_t length) {
+    char buffer[4096];
+    while (length > 0) {
+        ssize_t moved = splice(from, NULL, to, NULL, length, SPLICE_F_MOVE);
+        if (moved == -1 && errno == EINVAL) {
+            size_t chunk = length < sizeof(buffer) ? length : sizeof(buffer);
+            moved = read(from, buffer, chunk);
+            if (moved > 0 && write(to, buffer, moved) != moved) {
+                moved = -1;
+            }
+        }
+        if (moved <= 0) {
+            return -1;
+        }
+        length -= moved;
     }
-    close(pipefd[0]);
-    close(pipefd[1]);
     return 0;
 }
 
 /**
- * Execute a binary with `dup_to` redirected to `fd`, and close `fd` in both the
- * parent and the child.
+ * `tee [-a] file...` as a pipeline stage: copy stdin, which must be a pipe,
+ * to stdout and to every file. The data never passes through userspace:
+ * tee(2) duplicates what's in the input pipe into a pipe for every output but
+ * the last, without consuming it, and splice then moves each copy to its
+ * output. Stdout is tee'd into directly if it's a pipe; the other outputs
+ * get pipes of their own, as large as the input, so duplicating into them
+ * never comes up short. Returns the stage's exit status.
  * */
-int redirection(char **arglist, int fd, int dup_to) {
-    child1 = fork();
-    if (child1 < 0) {
-        perror("fork");
+int tee_stage(char **arglist) {
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    int noutputs = 1;
+    for (int i = 1; arglist[i]; i++) {
+        if (strcmp(arglist[i], "-a") == 0) {
+            flags = O_WRONLY | O_CREAT | O_APPEND;
+        } else {
+            noutputs++;
+        }
+    }
+    int *outputs = malloc(noutputs * sizeof(int));
+    int(*copies)[2] = malloc(noutputs * sizeof(*copies));
+    if (!outputs || !copies) {
+        perror("malloc");
         return 1;
     }
-    if (child1 == 0) {
-        dup2(fd, dup_to);
-        close(fd);
-        checked_exec(arglist);
+    int status = 0;
+    outputs[0] = STDOUT_FILENO;
+    noutputs = 1;
+    for (int i = 1; arglist[i]; i++) {
+        if (strcmp(arglist[i], "-a") == 0) {
+            continue;
+        }
+        int fd = open(arglist[i], flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd == -1) {
+            // Like tee(1), keep going with the other outputs
+            perror(arglist[i]);
+            status = 1;
+            continue;
+        }
+        outputs[noutputs++] = fd;
     }
-    close(fd);
-    return 0;
+
+    int in = STDIN_FILENO;
+    int capacity = fcntl(in, F_GETPIPE_SZ);
+    for (int i = 0; i < noutputs - 1; i++) {
+        copies[i][0] = copies[i][1] = -1;
+        if (i == 0 && is_pipe(outputs[0])) {
+            continue;
+        }
+        if (pipe(copies[i]) == -1) {
+            perror("pipe");
+            return 1;
+        }
+        fcntl(copies[i][1], F_SETPIPE_SZ, capacity);
+    }
+
+    for (;;) {
+        ssize_t length;
+        if (noutputs == 1) {
+            length = splice(in, NULL, outputs[0], NULL, TEE_CHUNK,
+                            SPLICE_F_MOVE);
+            if (length == -1 && errno == EINVAL) {
+                // Stdout doesn't take splice (a terminal, or a file opened
+                // with O_APPEND), so copy like `splice_all` does
+                char buffer[4096];
+                length = read(in, buffer, sizeof(buffer));
+                if (length > 0 &&
+                    write(outputs[0], buffer, length) != length) {
+                    length = -1;
+                }
+            }
+        } else {
+            // Whatever the first output takes sets how much every other one
+            // gets this time around
+            int target = copies[0][1] != -1 ? copies[0][1] : outputs[0];
+            length = tee(in, target, TEE_CHUNK, 0);
+            for (int i = 1; i < noutputs - 1 && length > 0; i++) {
+                if (tee(in, copies[i][1], length, 0) != length) {
+                    length = -1;
+                }
+            }
+            for (int i = 0; i < noutputs - 1 && length > 0; i++) {
+                if (copies[i][0] != -1 &&
+                    splice_all(copies[i][0], outputs[i], length) == -1) {
+                    length = -1;
+                }
+            }
+            if (length > 0 &&
+                splice_all(in, outputs[noutputs - 1], length) == -1) {
+                length = -1;
+            }
+        }
+        if (length <= 0) {
+            if (length == -1) {
+                perror("tee");
+                status = 1;
+            }
+            break;
+        }
+    }
+    return status;
 }
 
-int process_arglist(int count, char **arglist) {
-    int index;
-    if (strcmp(arglist[count - 1], "&") == 0) {
-        // Run in background
-        arglist[count - 1] = NULL;
-        int child = fork();
+/**
+ * Whether `tee_stage` can run `arglist`. It only knows `-a` (anywhere, like
+ * tee(1) takes it), so any other option, `--`, or `-` is left to the real
+ * tee rather than taken for a file name.
+ * */
+int tee_stage_handles(char **arglist) {
+    for (int i = 1; arglist[i]; i++) {
+        if (arglist[i][0] == '-' && strcmp(arglist[i], "-a") != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * Start the `tee` stage `arglist` in a forked child, redirected like
+ * `launch` does.
+ * */
+pid_t launch_tee(char **arglist, const int redirect[3],
+                 const int close_fds[3]) {
+    pid_t child = fork();
+    if (child < 0) {
+        perror("fork");
+    }
+    if (child == 0) {
+        // exec isn't there to reset the shell's handlers
+        signal(SIGINT, SIG_DFL);
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+        redirect_child(redirect, close_fds);
+        // Not exit, which would flush the shell's stdio buffers a second time
+        _exit(tee_stage(arglist));
+    }
+    return child;
+}
+
+/**
+ * Start `arglist` in a child, with its stdin, stdout and stderr redirected to
+ * the fds in `redirect` (-1 to keep the shell's), and the `close_fds` (-1
+ * for none) closed. The redirected fds are closed in the child once they're in
+ * place. Returns the child's pid, or -1 if it couldn't be started.
+ *
+ * Uses posix_spawn, which starts the child without copying the shell's page
+ * tables the way fork does, so launching stays cheap however large the shell
+ * gets. `tee` reading from a pipe, with no option but `-a`, runs in the
+ * shell's own code instead, see `tee_stage`.
+ * */
+pid_t launch(char **arglist, const int redirect[3], const int close_fds[3]) {
+    if (!arglist[0]) {
+        fprintf(stderr, "exec: missing command\n");
+        return -1;
+    }
+    if (strcmp(arglist[0], "tee") == 0 && tee_stage_handles(arglist) &&
+        redirect[STDIN_FILENO] != -1 && is_pipe(redirect[STDIN_FILENO])) {
+        return launch_tee(arglist, redirect, close_fds);
+    }
+    const char *path = resolve_command(arglist[0]);
+    if (!path) {
+        perror("exec");
+        return -1;
+    }
+    if (launch_with_fork) {
+        pid_t child = fork();
         if (child < 0) {
             perror("fork");
-            return 1;
         }
         if (child == 0) {
-            checked_exec(arglist);
+            sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
+            redirect_child(redirect, close_fds);
+            checked_exec(path, arglist);
+            // Should not return
         }
-    } else if ((index = find(count, arglist, "|")) != -1) {
-        arglist[index] = NULL;
-        pipe_between(arglist, &arglist[index + 1]);
-    } else if ((index = find(count, arglist, "<")) != -1) {
-        int fd = open(arglist[index + 1], 0);
-        if (fd == -1) {
-            perror("file");
-            return 1;
+        return child;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    for (int i = 0; i < 3; i++) {
+        if (close_fds[i] != -1) {
+            posix_spawn_file_actions_addclose(&actions, close_fds[i]);
+        }
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (redirect[fd] != -1) {
+            posix_spawn_file_actions_adddup2(&actions, redirect[fd], fd);
+        }
+    }
+    for (int fd = 0; fd < 3; fd++) {
+        if (closes_redirect(redirect, fd)) {
+            posix_spawn_file_actions_addclose(&actions, redirect[fd]);
+        }
+    }
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setsigmask(&attributes, &child_sigmask);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETSIGMASK);
+    pid_t child;
+    // Reports exec failures too, since the parent waits for the exec
+    int error =
+        posix_spawn(&child, path, &actions, &attributes, arglist, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (error) {
+        errno = error;
+        perror("exec");
+        return -1;
+    }
+    return child;
+}
+
+/**
+ * Join `arglist` into one string, separated by spaces. Returns NULL if it
+ * can't be allocated.
+ * */
+char *join_words(char **arglist) {
+    size_t length = 1;
+    for (int i = 0; arglist[i]; i++) {
+        length += strlen(arglist[i]) + 1;
+    }
+    char *joined = malloc(length);
+    if (joined) {
+        joined[0] = '\0';
+        for (int i = 0; arglist[i]; i++) {
+            if (i > 0) {
+                strcat(joined, " ");
+            }
+            strcat(joined, arglist[i]);
+        }
+    }
+    return joined;
+}
+
+/**
+ * Run the stages of `arglist` separated by `|` (1 | 2 | ... | n) concurrently,
+ * piping each stage's output straight into the next one's input. Each stage
+ * may also redirect its stdin (`<`), stdout (`>`, `>>`) and stderr (`2>`),
+ * which takes precedence over the pipes, like in bash. Each pipe is only
+ * created right before the stage writing into it is started, so every stage
+ * inherits just the two ends it uses. Quoted words, per `quoted`, are never
+ * operators.
+ * */
+int pipeline(int count, char **arglist, char *quoted) {
+    char **stage = arglist;
+    char *stage_quoted = quoted;
+    int prev_read = -1;
+    for (int i = 0; i <= count; i++) {
+        if (i < count && !is_op(arglist, quoted, i, "|")) {
+            continue;
         }
-        arglist[index] = NULL;
-
-        redirection(arglist, fd, STDIN_FILENO);
-    } else if ((index = find(count, arglist, ">>")) != -1) {
-        // Open the file in append mode, creating if neccasary with `311`
-        // permissions (read / write for user, read for everyone else)
-        int fd = open(arglist[index + 1], O_CREAT | O_APPEND | O_WRONLY,
-                      S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-        // Shorten `arglist` to not include `>> filename`
-        arglist[index] = NULL;
-        redirection(arglist, fd, STDOUT_FILENO);
+        int last = i == count;
+        int pipefd[2] = {-1, -1};
+        arglist[i] = NULL;
+        if (!last) {
+            if (pipe(pipefd) == -1) {
+                perror("pipe");
+                break;
+            }
+            if (pipe_size > 0 &&
+                fcntl(pipefd[1], F_SETPIPE_SZ, pipe_size) == -1) {
+                perror("pipe size");
+            }
+        }
+
+        // A stage that fails to start just leaves its neighbours with a
+        // closed pipe, like one that exits right away would
+        char *command = profile_log ? join_words(stage) : NULL;
+        int opened[3] = {-1, -1, -1};
+        if (open_redirections(stage, stage_quoted, opened) == 0) {
+            int redirect[3] = {prev_read, pipefd[1], -1};
+            // The pipe ends a redirection replaces are closed in the child,
+            // or the stage on their other side would never see EOF
+            int close_fds[3] = {pipefd[0], -1, -1};
+            if (opened[STDIN_FILENO] != -1) {
+                close_fds[1] = prev_read;
+            }
+            if (opened[STDOUT_FILENO] != -1) {
+                close_fds[2] = pipefd[1];
+            }
+            for (int fd = 0; fd < 3; fd++) {
+                if (opened[fd] != -1) {
+                    redirect[fd] = opened[fd];
+                }
+            }
+            double started = now_seconds();
+            pid_t child = launch(stage, redirect, close_fds);
+            if (child > 0) {
+                struct child *entry = &children[nchildren];
+                entry->pid = child;
+                entry->started = started;
+                entry->launch_seconds = now_seconds() - started;
+                entry->command = command;
+                command = NULL;
+                nchildren++;
+            }
+            close_redirections(opened);
+        }
+        free(command);
+        if (prev_read != -1) {
+            close(prev_read);
+        }
+        if (pipefd[1] != -1) {
+            close(pipefd[1]);
+        }
+        prev_read = pipefd[0];
+        stage = &arglist[i + 1];
+        stage_quoted = quoted ? &quoted[i + 1] : NULL;
+    }
+    if (prev_read != -1) {
+        close(prev_read);
+    }
+    return 0;
+}
+
+/**
+ * Add a job for `child`, running `command`. SIGCHLD must be blocked from
+ * before `child` was started, so it can't be missed.
+ * */
+void add_job(const struct child *child, const char *command) {
+    if (njobs == jobs_capacity) {
+        int capacity = jobs_capacity ? jobs_capacity * 2 : 16;
+        struct job *new_jobs = realloc(jobs, capacity * sizeof(struct job));
+        if (!new_jobs) {
+            // Nothing will reap it now, so treat it as a foreground child
+            perror("malloc");
+            waitpid(child->pid, NULL, 0);
+            return;
+        }
+        jobs = new_jobs;
+        jobs_capacity = capacity;
+    }
+
+    struct job *job = &jobs[njobs];
+    memset(job, 0, sizeof(*job));
+    job->id = njobs > 0 ? jobs[njobs - 1].id + 1 : 1;
+    job->pid = child->pid;
+    job->command = command ? strdup(command) : NULL;
+    job->running = 1;
+    job->started = child->started;
+    job->launch_seconds = child->launch_seconds;
+    njobs++;
+    printf("[%d] %d\n", job->id, child->pid);
+    fflush(stdout);
+}
+
+void print_job(struct job *job) {
+    printf("[%d] %d ", job->id, job->pid);
+    if (job->running) {
+        printf("Running");
     } else {
-        // Run in foreground
-        child1 = fork();
-        if (child1 < 0) {
-            perror("fork");
+        if (WIFEXITED(job->status)) {
+            printf("Done (exit %d)", WEXITSTATUS(job->status));
+        } else {
+            printf("Killed (signal %d)", WTERMSIG(job->status));
+        }
+        printf(" user %ld.%03lds sys %ld.%03lds maxrss %ld KiB",
+               job->usage.ru_utime.tv_sec, job->usage.ru_utime.tv_usec / 1000,
+               job->usage.ru_stime.tv_sec, job->usage.ru_stime.tv_usec / 1000,
+               job->usage.ru_maxrss);
+    }
+    printf("  %s\n", job->command ? job->command : "");
+}
+
+/**
+ * Whether `job` is one of the jobs named by `arglist` (`%id` or a pid), or
+ * any job if there are no names.
+ * */
+int job_matches(struct job *job, int count, char **arglist) {
+    if (count == 1) {
+        return 1;
+    }
+    for (int i = 1; i < count; i++) {
+        if (arglist[i][0] == '%' ? atoi(&arglist[i][1]) == job->id
+                                 : atoi(arglist[i]) == job->pid) {
             return 1;
         }
-        if (child1 == 0) {
-            checked_exec(arglist);
+    }
+    return 0;
+}
+
+void profile_job(struct job *job) {
+    record_profile(job->command, job->pid, job->status,
+                   job->ended - job->started, job->launch_seconds,
+                   &job->usage);
+}
+
+/**
+ * Print the jobs named by `arglist` (all of them if none are), or only the
+ * ones that are done if `done_only`, and forget the ones that are done.
+ * SIGCHLD must be blocked.
+ * */
+void report_jobs(int count, char **arglist, int done_only) {
+    int kept = 0;
+    for (int i = 0; i < njobs; i++) {
+        if (job_matches(&jobs[i], count, arglist) &&
+            !(done_only && jobs[i].running)) {
+            print_job(&jobs[i]);
+            if (!jobs[i].running) {
+                profile_job(&jobs[i]);
+                free(jobs[i].command);
+                continue;
+            }
         }
+        jobs[kept++] = jobs[i];
     }
+    njobs = kept;
+    fflush(stdout);
+}
 
-    if (child1 > 0) {
-        waitpid(child1, NULL, 0);
+/**
+ * `jobs`: list the background jobs, with the exit status and resource usage
+ * of those that are done.
+ * */
+int builtin_jobs(int count, char **arglist) {
+    sigset_t old_mask;
+    block_sigchld(&old_mask);
+    report_jobs(count, arglist, 0);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+}
+
+/**
+ * `wait [%id | pid]...`: wait for the given background jobs, or for all of
+ * them, to finish, and report them. Sleeps until the SIGCHLD handler reaps
+ * them, or until interrupted by `^C`.
+ * */
+int builtin_wait(int count, char **arglist) {
+    sigset_t old_mask;
+    block_sigchld(&old_mask);
+    for (int i = 1; i < count; i++) {
+        int found = 0;
+        for (int j = 0; j < njobs && !found; j++) {
+            found = job_matches(&jobs[j], 2, &arglist[i - 1]);
+        }
+        if (!found) {
+            fprintf(stderr, "wait: %s: no such job\n", arglist[i]);
+        }
     }
-    if (child2 > 0) {
-        waitpid(child2, NULL, 0);
+    interrupted = 0;
+    while (!interrupted) {
+        int pending = 0;
+        for (int i = 0; i < njobs; i++) {
+            pending |= jobs[i].running && job_matches(&jobs[i], count, arglist);
+        }
+        if (!pending) {
+            break;
+        }
+        sigsuspend(&old_mask);
+    }
+    report_jobs(count, arglist, 0);
+    sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    return 1;
+}
+
+int builtin_cd(int count, char **arglist) {
+    const char *dir = count > 1 ? arglist[1] : getenv("HOME");
+    if (!dir || chdir(dir) == -1) {
+        perror("cd");
+        return 1;
+    }
+    // Relative PATH entries now name other directories: forget what was
+    // found through them, and watch them again
+    flush_path_cache();
+    free(cached_path_var);
+    cached_path_var = NULL;
+    return 1;
+}
+
+int builtin_exit(int count, char **arglist) { return 0; }
+
+int builtin_echo(int count, char **arglist) {
+    int newline = count < 2 || strcmp(arglist[1], "-n") != 0;
+    for (int i = newline ? 1 : 2; i < count; i++) {
+        fputs(arglist[i], stdout);
+        if (i + 1 < count) {
+            putchar(' ');
+        }
+    }
+    if (newline) {
+        putchar('\n');
+    }
+    // Before anything the next command's children print
+    fflush(stdout);
+    return 1;
+}
+
+int builtin_true(int count, char **arglist) { return 1; }
+
+int builtin_pwd(int count, char **arglist) {
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        perror("pwd");
+        return 1;
+    }
+    printf("%s\n", cwd);
+    fflush(stdout);
+    free(cwd);
+    return 1;
+}
+
+/**
+ * `hash`: list the cached command paths, with how often each was used.
+ * `hash -r`: forget them.
+ * */
+int builtin_hash(int count, char **arglist) {
+    if (count > 1 && strcmp(arglist[1], "-r") == 0) {
+        flush_path_cache();
+        return 1;
+    }
+    printf("hits\tcommand\n");
+    for (int i = 0; i < PATH_CACHE_BUCKETS; i++) {
+        for (struct path_entry *entry = path_cache[i]; entry;
+             entry = entry->next) {
+            printf("%4u\t%s\n", entry->hits, entry->path);
+        }
+    }
+    fflush(stdout);
+    return 1;
+}
+
+/**
+ * `profile file`: log the timing and resource usage of every command to
+ * `file`, as CSV, and print a summary on exit. `profile off`: stop logging.
+ * */
+int builtin_profile(int count, char **arglist) {
+    if (count != 2) {
+        fprintf(stderr, "usage: profile file | off\n");
+    } else if (strcmp(arglist[1], "off") == 0) {
+        if (profile_log) {
+            fclose(profile_log);
+            profile_log = NULL;
+        }
+    } else {
+        start_profiling(arglist[1]);
     }
-    child1 = -1;
-    child2 = -1;
     return 1;
 }
 
-int finalize() { return 0; }
+/**
+ * Commands run inside the shell, without starting a process. Each returns
+ * what `process_arglist` should.
+ * */
+struct builtin {
+    const char *name;
+    int (*run)(int count, char **arglist);
+};
+
+struct builtin builtins[] = {
+    {"cd", builtin_cd},       {"exit", builtin_exit},
+    {"echo", builtin_echo},   {"true", builtin_true},
+    {"pwd", builtin_pwd},     {"hash", builtin_hash},
+    {"jobs", builtin_jobs},   {"wait", builtin_wait},
+    {"profile", builtin_profile},
+};
+
+/**
+ * Find the builtin `arglist` runs, if it's a plain command: with pipes,
+ * redirections or `&`, the command runs in a child like any other, so
+ * `echo` and friends come from PATH.
+ * */
+struct builtin *find_builtin(int count, char **arglist,
+                             const char *quoted) {
+    if (is_op(arglist, quoted, count - 1, "&")) {
+        return NULL;
+    }
+    for (int i = 0; i < count; i++) {
+        if (is_operator(arglist, quoted, i)) {
+            return NULL;
+        }
+    }
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++) {
+        if (strcmp(arglist[0], builtins[i].name) == 0) {
+            return &builtins[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Whether `arglist` is a plain `cd`, `exit`, `hash` or `profile`, which change
+ * the shell's own state. Batch mode runs these in the shell instead of in a
+ * worker, so the jobs after them see the change.
+ * */
+int changes_shell(int count, char **arglist, const char *quoted) {
+    static const char *names[] = {"cd", "exit", "hash", "profile"};
+    struct builtin *builtin = find_builtin(count, arglist, quoted);
+    for (size_t i = 0; builtin && i < sizeof(names) / sizeof(names[0]); i++) {
+        if (strcmp(builtin->name, names[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Run `arglist` like `process_arglist`, except that the words `quoted` marks
+ * as quoted or escaped are plain arguments even where they read like `|`,
+ * `&` or a redirection.
+ * */
+int process_arglist_quoted(int count, char **arglist, char *quoted) {
+    if (njobs > 0) {
+        // Like bash before its prompt, so done jobs don't pile up, and the
+        // SIGCHLD handler only walks the running ones and the newly done
+        sigset_t old_mask;
+        block_sigchld(&old_mask);
+        report_jobs(1, arglist, 1);
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+    }
+    struct builtin *builtin = find_builtin(count, arglist, quoted);
+    if (builtin) {
+        return builtin->run(count, arglist);
+    }
+    children = malloc(count * sizeof(struct child));
+    if (!children) {
+        perror("malloc");
+        return 1;
+    }
+    if (is_op(arglist, quoted, count - 1, "&")) {
+        // Run in background, as a job per stage
+        arglist[--count] = NULL;
+        char *command = join_words(arglist);
+        sigset_t old_mask;
+        block_sigchld(&old_mask);
+        pipeline(count, arglist, quoted);
+        for (int i = 0; i < nchildren; i++) {
+            add_job(&children[i], command);
+            free(children[i].command);
+        }
+        nchildren = 0;
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        free(command);
+    } else {
+        pipeline(count, arglist, quoted);
+    }
+
+    // Children are reaped in the order they were started, so one that exits
+    // before an earlier one is timed until that one exits. In a pipeline
+    // that's rare, since stages mostly exit once the stage before them has.
+    for (int i = 0; i < nchildren; i++) {
+        int status;
+        struct rusage usage;
+        if (wait4(children[i].pid, &status, 0, &usage) > 0) {
+            record_profile(children[i].command, children[i].pid, status,
+                           now_seconds() - children[i].started,
+                           children[i].launch_seconds, &usage);
+        }
+        free(children[i].command);
+    }
+    nchildren = 0;
+    free(children);
+    children = NULL;
+    return 1;
+}
+
+int process_arglist(int count, char **arglist) {
+    return process_arglist_quoted(count, arglist, NULL);
+}
+
+/**
+ * Print the totals of everything profiled this session, and the slowest
+ * commands.
+ * */
+void print_profile_summary() {
+    struct profile_summary *summary = profile_summary;
+    fprintf(stderr,
+            "profile: %ld commands, wall %.3fs, launch %.3fs, user %.3fs, "
+            "sys %.3fs, max rss %ld KiB, context switches %ld voluntary "
+            "%ld involuntary\n",
+            summary->commands, summary->wall_seconds, summary->launch_seconds,
+            summary->user_seconds, summary->system_seconds,
+            summary->max_rss_kib, summary->voluntary_switches,
+            summary->involuntary_switches);
+    for (int i = 0; i < PROFILE_SLOWEST && i < summary->commands; i++) {
+        fprintf(stderr, "  %10.3fs  %s\n", summary->slowest[i].wall_seconds,
+                summary->slowest[i].command);
+    }
+}
+
+int finalize() {
+    if (profile_summary) {
+        // Background jobs that finished without being reported by `jobs` or
+        // `wait` are still logged
+        sigset_t old_mask;
+        block_sigchld(&old_mask);
+        for (int i = 0; i < njobs; i++) {
+            if (!jobs[i].running) {
+                profile_job(&jobs[i]);
+            }
+        }
+        sigprocmask(SIG_SETMASK, &old_mask, NULL);
+        print_profile_summary();
+    }
+    if (profile_log) {
+        fclose(profile_log);
+        profile_log = NULL;
+    }
+    return 0;
+}
@@ -0,0 +1,107 @@
+/**
+ * Checks that quoted or escaped words are plain arguments, never `|`, `&` or
+ * redirections, both for builtins and for commands run from PATH. Runs in a
+ * fresh directory under /tmp. Build it with the shell in place of shell.c:
+ *
+ *     gcc quoting_test.c myshell.c tokenize.c -o quoting_test
+ *     ./quoting_test
+ * */
+#define _GNU_SOURCE
+#include "tokenize.h"
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+int prepare(void);
+int process_arglist_quoted(int count, char **arglist, char *quoted);
+
+/**
+ * Runs `line` like the shell's read loop would, and returns what it wrote
+ * to stdout, which the caller frees.
+ * */
+char *run_line(const char *line) {
+    FILE *in = fmemopen((void *)line, strlen(line), "r");
+    struct reader reader = {0};
+    char **arglist;
+    int count = read_arglist(&reader, in, &arglist);
+    assert(count > 0);
+
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int out = open("out", O_RDWR | O_CREAT | O_TRUNC, 0644);
+    assert(saved_stdout != -1 && out != -1);
+    dup2(out, STDOUT_FILENO);
+    process_arglist_quoted(count, arglist, reader.quoted);
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+
+    char *output = calloc(1, 4096);
+    pread(out, output, 4095, 0);
+    close(out);
+    unlink("out");
+    reader_free(&reader);
+    fclose(in);
+    return output;
+}
+
+void assert_output(const char *line, const char *expected) {
+    char *output = run_line(line);
+    if (strcmp(output, expected) != 0) {
+        fprintf(stderr, "%s: got \"%s\", expected \"%s\"\n", line, output,
+                expected);
+        assert(0);
+    }
+    free(output);
+}
+
+void test_tokenize() {
+    char line[] = "a '|' b\\& \"c d\" e";
+    char *words[sizeof(line) / 2 + 2];
+    char quoted[sizeof(line) / 2 + 2];
+    assert(tokenize(line, strlen(line), words, quoted) == 5);
+    const char *expected_words[] = {"a", "|", "b&", "c d", "e"};
+    const char expected_quoted[] = {0, 1, 1, 1, 0};
+    for (int i = 0; i < 5; i++) {
+        assert(strcmp(words[i], expected_words[i]) == 0);
+        assert(quoted[i] == expected_quoted[i]);
+    }
+    assert(words[5] == NULL);
+}
+
+void test_builtins() {
+    assert_output("echo '|' hi\n", "| hi\n");
+    assert_output("echo a '&'\n", "a &\n");
+    assert_output("echo a \\&\n", "a &\n");
+    assert_output("echo '>' f\n", "> f\n");
+    assert_output("echo \"2>\" f '<' g\n", "2> f < g\n");
+    assert(access("f", F_OK) == -1);
+}
+
+void test_commands() {
+    assert_output("/bin/echo a '|' b\n", "a | b\n");
+    assert_output("/bin/echo '>>' f \\&\n", ">> f &\n");
+    assert(access("f", F_OK) == -1);
+    // Unquoted, they're still operators
+    assert_output("/bin/echo a | /bin/cat\n", "a\n");
+    assert_output("echo a > f\n", "");
+    assert(access("f", F_OK) == 0);
+    unlink("f");
+}
+
+int main() {
+    char dir[] = "/tmp/quoting_test.XXXXXX";
+    assert(mkdtemp(dir) && chdir(dir) == 0);
+    assert(prepare() == 0);
+
+    test_tokenize();
+    test_builtins();
+    test_commands();
+
+    rmdir(dir);
+    printf("PASSED\n");
+    return 0;
+}
@@ -3,62 +3,210 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "tokenize.h"
 
 // arglist - a list of char* arguments (words) provided by the user
 // it contains count+1 items, where the last item (arglist[count]) and *only* the last is NULL
 // RETURNS - 1 if should continue, 0 otherwise
 int process_arglist(int count, char** arglist);
+// Same, except that the words quoted[i] marks as quoted or escaped are never
+// taken for operators
+int process_arglist_quoted(int count, char** arglist, char* quoted);
+// Whether arglist is a builtin that changes the shell itself, like `cd`, and
+// runs in the shell rather than as a command of its own
+int changes_shell(int count, char** arglist, const char* quoted);
 
 // prepare and finalize calls for initialization and destruction of anything required
 int prepare(void);
 int finalize(void);
 
-int main(void)
+// A command of a batch script, and whether the commands after it have to
+// wait for it and everything before it (`;` or a newline), or may run
+// alongside it (`&`)
+struct job {
+	int start;	// Index of its first word in the script's words
+	int count;
+	int barrier;
+};
+
+static void append(void** array, int* capacity, int count, size_t size)
+{
+	if (count < *capacity)
+		return;
+	*capacity = *capacity ? *capacity * 2 : 64;
+	*array = realloc(*array, size * *capacity);
+	if (*array == NULL) {
+		printf("realloc failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+// Waits for any running job. Returns 0 once there are none left.
+static int wait_job(void)
+{
+	while (wait(NULL) == -1) {
+		if (errno != EINTR)
+			return 0;
+	}
+	return 1;
+}
+
+// Reads the whole script, splits it into jobs at `;`, `&` and newlines, and
+// runs them, at most max_jobs at a time. Separators are words of their own,
+// like `|` and `&` in interactive mode, and unquoted.
+static void run_batch(FILE* script, int max_jobs)
+{
+	struct reader reader = {0};
+	// Holds the words of the whole script, while reader's arena is reused
+	// for every line
+	struct arena script_arena = {0};
+	char** words = NULL;
+	char* quoted = NULL;	// Whether each of words was quoted or escaped
+	struct job* jobs = NULL;
+	int nwords = 0, words_capacity = 0, quoted_capacity = 0;
+	int njobs = 0, jobs_capacity = 0;
+	int start = 0;
+
+	while (1) {
+		char** arglist = NULL;
+		int eof = read_arglist(&reader, script, &arglist) == -1;
+		for (int i = 0; ; i++) {
+			char* word = eof ? NULL : arglist[i];
+			int separator = word == NULL || (!reader.quoted[i] &&
+				(strcmp(word, ";") == 0 || strcmp(word, "&") == 0));
+			append((void**)&quoted, &quoted_capacity, nwords, sizeof(char));
+			if (!separator) {
+				append((void**)&words, &words_capacity, nwords, sizeof(char*));
+				quoted[nwords] = reader.quoted[i];
+				words[nwords] = arena_strdup(&script_arena, word);
+				if (words[nwords++] == NULL) {
+					printf("malloc failed: %s\n", strerror(errno));
+					exit(1);
+				}
+			} else if (nwords > start) {
+				append((void**)&words, &words_capacity, nwords, sizeof(char*));
+				quoted[nwords] = 0;
+				words[nwords++] = NULL;
+				append((void**)&jobs, &jobs_capacity, njobs, sizeof(struct job));
+				jobs[njobs].start = start;
+				jobs[njobs].count = nwords - 1 - start;
+				jobs[njobs].barrier = word == NULL || word[0] == ';';
+				njobs++;
+				start = nwords;
+			}
+			if (word == NULL)
+				break;
+		}
+		if (eof)
+			break;
+	}
+	reader_free(&reader);
+
+	// Flushed now, so forked jobs don't print it again
+	fflush(stdout);
+	int running = 0;
+	for (int i = 0; i < njobs; i++) {
+		char** job = &words[jobs[i].start];
+		char* job_quoted = &quoted[jobs[i].start];
+		if (changes_shell(jobs[i].count, job, job_quoted)) {
+			// Run here, once everything before it is done, so the jobs
+			// after it are forked with its change
+			while (wait_job())
+				;
+			running = 0;
+			int keep_going = process_arglist_quoted(jobs[i].count, job,
+								job_quoted);
+			fflush(stdout);
+			if (!keep_going)
+				break;
+			continue;
+		}
+		if (running == max_jobs && wait_job())
+			running--;
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("fork");
+		} else if (pid == 0) {
+			process_arglist_quoted(jobs[i].count, job, job_quoted);
+			exit(0);
+		} else {
+			running++;
+		}
+		if (jobs[i].barrier) {
+			while (wait_job())
+				;
+			running = 0;
+		}
+	}
+	while (wait_job())
+		;
+
+	arena_free(&script_arena);
+	free(words);
+	free(quoted);
+	free(jobs);
+}
+
+// Usage: shell [-j N] [script]
+// Given a script or -j, runs the script (or stdin) as a batch, N jobs at a
+// time (1 by default). A plain `cd`, `exit`, `hash` or `profile` waits for
+// the jobs before it and runs in the shell itself, so it affects the jobs
+// after it: after an `exit`, jobs already running finish, but no later ones
+// start. Otherwise reads and runs one command at a time.
+int main(int argc, char** argv)
 {
+	FILE* script = stdin;
+	int max_jobs = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "j:")) != -1) {
+		if (opt != 'j' || atoi(optarg) < 1) {
+			fprintf(stderr, "usage: %s [-j N] [script]\n", argv[0]);
+			exit(1);
+		}
+		max_jobs = atoi(optarg);
+	}
+	if (optind < argc) {
+		script = fopen(argv[optind], "r");
+		if (script == NULL) {
+			perror(argv[optind]);
+			exit(1);
+		}
+		if (max_jobs == 0)
+			max_jobs = 1;
+	}
+
 	if (prepare() != 0)
 		exit(1);
+
+	if (max_jobs > 0) {
+		// Jobs are reaped here with wait(), not by the SIGCHLD handler
+		// prepare() sets up for background jobs
+		signal(SIGCHLD, SIG_DFL);
+		run_batch(script, max_jobs);
+		if (finalize() != 0)
+			exit(1);
+		return 0;
+	}
 	
+	// The line buffer and arglist are reused from one line to the next
+	struct reader reader = {0};
 	while (1)
 	{
 		char** arglist = NULL;
-		char* line = NULL;
-		size_t size;
-		int count = 0;
+		int count = read_arglist(&reader, stdin, &arglist);
 
-		if (getline(&line, &size, stdin) == -1) {
-			free(line);
+		if (count == -1)
 			break;
-		}
-    
-		arglist = (char**) malloc(sizeof(char*));
-		if (arglist == NULL) {
-			printf("malloc failed: %s\n", strerror(errno));
-			exit(1);
-		}
-		arglist[0] = strtok(line, " \t\n");
-    
-		while (arglist[count] != NULL) {
-			++count;
-			arglist = (char**) realloc(arglist, sizeof(char*) * (count + 1));
-			if (arglist == NULL) {
-				printf("realloc failed: %s\n", strerror(errno));
-				exit(1);
-			}
-      
-			arglist[count] = strtok(NULL, " \t\n");
-		}
-    
 		if (count != 0) {
-			if (!process_arglist(count, arglist)) {
-				free(line);
-				free(arglist);
+			if (!process_arglist_quoted(count, arglist, reader.quoted))
 				break;
-			}
 		}
-    
-		free(line);
-		free(arglist);
 	}
+	reader_free(&reader);
 	
 	if (finalize() != 0)
 		exit(1);
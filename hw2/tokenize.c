@@ -0,0 +1,228 @@
+#define _GNU_SOURCE
+#include "tokenize.h"
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+    char data[];
+};
+
+void *arena_alloc(struct arena *arena, size_t size) {
+    size = (size + 15) & ~(size_t)15;
+    while (!arena->current || arena->used + size > arena->current->size) {
+        struct arena_chunk *next =
+            arena->current ? arena->current->next : arena->first;
+        if (!next || next->size < size) {
+            // Chunks are kept across resets, so once the arena is warm only
+            // a line longer than any before it allocates
+            size_t chunk_size =
+                size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+            struct arena_chunk *chunk = malloc(sizeof(*chunk) + chunk_size);
+            if (!chunk) {
+                return NULL;
+            }
+            chunk->size = chunk_size;
+            chunk->next = next;
+            if (arena->current) {
+                arena->current->next = chunk;
+            } else {
+                arena->first = chunk;
+            }
+            next = chunk;
+        }
+        arena->current = next;
+        arena->used = 0;
+    }
+    void *allocation = arena->current->data + arena->used;
+    arena->used += size;
+    return allocation;
+}
+
+char *arena_strdup(struct arena *arena, const char *string) {
+    size_t length = strlen(string) + 1;
+    char *copy = arena_alloc(arena, length);
+    if (copy) {
+        memcpy(copy, string, length);
+    }
+    return copy;
+}
+
+void arena_reset(struct arena *arena) {
+    arena->current = arena->first;
+    arena->used = 0;
+}
+
+void arena_free(struct arena *arena) {
+    struct arena_chunk *chunk = arena->first;
+    while (chunk) {
+        struct arena_chunk *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    memset(arena, 0, sizeof(*arena));
+}
+
+static inline int is_blank(char c) { return c == ' ' || c == '\t' || c == '\n'; }
+
+static inline int is_special(char c) {
+    return is_blank(c) || c == '\'' || c == '"' || c == '\\';
+}
+
+/**
+ * Returns the first blank, quote or backslash in `[p, end)`, or `end`. Looks
+ * at 16 bytes at a time where SSE2 is available.
+ * */
+static const char *find_special(const char *p, const char *end) {
+#ifdef __SSE2__
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    const __m128i single_quote = _mm_set1_epi8('\'');
+    const __m128i double_quote = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    while (end - p >= 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)p);
+        __m128i hits = _mm_or_si128(
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, space),
+                         _mm_cmpeq_epi8(chunk, tab)),
+            _mm_or_si128(_mm_cmpeq_epi8(chunk, newline),
+                         _mm_cmpeq_epi8(chunk, single_quote)));
+        hits = _mm_or_si128(hits,
+                            _mm_or_si128(_mm_cmpeq_epi8(chunk, double_quote),
+                                         _mm_cmpeq_epi8(chunk, backslash)));
+        int mask = _mm_movemask_epi8(hits);
+        if (mask) {
+            return p + __builtin_ctz(mask);
+        }
+        p += 16;
+    }
+#endif
+    while (p < end && !is_special(*p)) {
+        p++;
+    }
+    return p;
+}
+
+/**
+ * Splits `line`, `length` bytes long and NUL-terminated, into words in a
+ * single pass, in place, and points `words` at them, followed by a NULL.
+ * Words are separated by blanks. '...' quotes everything up to the next
+ * quote, "..." does too except for `\"` and `\\`, and a backslash outside
+ * quotes escapes the character after it. The quotes and escapes are removed
+ * from the words, and `quoted` records which words had any, since `'|'` or
+ * `\&` is a plain word, not an operator.
+ *
+ * `words` must have room for `length / 2 + 2` pointers, one more than the
+ * most words `line` could hold, and `quoted` for as many flags. Returns the
+ * number of words, or -1 if a quote isn't closed.
+ * */
+int tokenize(char *line, size_t length, char **words, char *quoted) {
+    char *read = line;
+    char *end = line + length;
+    int count = 0;
+    for (;;) {
+        while (read < end && is_blank(*read)) {
+            read++;
+        }
+        if (read == end) {
+            break;
+        }
+        // Unquoting only ever shortens a word, so it's written back over
+        // itself, trailing behind `read`
+        char *write = read;
+        quoted[count] = 0;
+        words[count++] = write;
+        while (read < end) {
+            char *special = (char *)find_special(read, end);
+            if (write != read) {
+                memmove(write, read, special - read);
+            }
+            write += special - read;
+            read = special;
+            if (read == end || is_blank(*read)) {
+                break;
+            }
+            quoted[count - 1] = 1;
+            if (*read == '\'') {
+                char *close = memchr(read + 1, '\'', end - read - 1);
+                if (!close) {
+                    return -1;
+                }
+                memmove(write, read + 1, close - read - 1);
+                write += close - read - 1;
+                read = close + 1;
+            } else if (*read == '"') {
+                read++;
+                while (read < end && *read != '"') {
+                    if (*read == '\\' && read + 1 < end &&
+                        (read[1] == '"' || read[1] == '\\')) {
+                        read++;
+                    }
+                    *write++ = *read++;
+                }
+                if (read == end) {
+                    return -1;
+                }
+                read++;
+            } else {
+                // An escaped newline is just dropped
+                read++;
+                if (read < end && *read != '\n') {
+                    *write++ = *read++;
+                }
+            }
+        }
+        // `write` may be at `end`, where the NUL already is
+        char *next = read < end ? read + 1 : read;
+        *write = '\0';
+        read = next;
+    }
+    words[count] = NULL;
+    quoted[count] = 0;
+    return count;
+}
+
+/**
+ * Reads the next line of `in` and splits it into `*arglist`, which stays
+ * valid until the next call, as does `reader->quoted`. Returns the number of
+ * words, or -1 at the end of `in`. Lines with an unclosed quote are reported
+ * and come back empty.
+ * */
+int read_arglist(struct reader *reader, FILE *in, char ***arglist) {
+    ssize_t length = getline(&reader->line, &reader->size, in);
+    if (length == -1) {
+        return -1;
+    }
+    arena_reset(&reader->arena);
+    *arglist = arena_alloc(&reader->arena, sizeof(char *) * (length / 2 + 2));
+    reader->quoted = arena_alloc(&reader->arena, length / 2 + 2);
+    if (!*arglist || !reader->quoted) {
+        printf("malloc failed: %s\n", strerror(errno));
+        exit(1);
+    }
+    int count = tokenize(reader->line, length, *arglist, reader->quoted);
+    if (count < 0) {
+        fprintf(stderr, "syntax error: unclosed quote\n");
+        (*arglist)[0] = NULL;
+        count = 0;
+    }
+    return count;
+}
+
+void reader_free(struct reader *reader) {
+    free(reader->line);
+    arena_free(&reader->arena);
+    memset(reader, 0, sizeof(*reader));
+}
@@ -0,0 +1,42 @@
+#ifndef TOKENIZE_H
+#define TOKENIZE_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+/**
+ * A bump allocator. Everything allocated from it lives until the next
+ * `arena_reset`, which keeps the memory around to be handed out again rather
+ * than freeing it.
+ * */
+struct arena_chunk;
+struct arena {
+    struct arena_chunk *first;
+    struct arena_chunk *current;
+    size_t used; // Bytes of `current` handed out
+};
+
+void *arena_alloc(struct arena *arena, size_t size);
+char *arena_strdup(struct arena *arena, const char *string);
+void arena_reset(struct arena *arena);
+void arena_free(struct arena *arena);
+
+int tokenize(char *line, size_t length, char **words, char *quoted);
+
+/**
+ * Reads commands a line at a time, reusing the same line buffer and arena for
+ * every line.
+ * */
+struct reader {
+    char *line;
+    size_t size;
+    struct arena arena;
+    // For each word of the last line read, whether any of it was quoted or
+    // escaped, so it's never taken for an operator
+    char *quoted;
+};
+
+int read_arglist(struct reader *reader, FILE *in, char ***arglist);
+void reader_free(struct reader *reader);
+
+#endif
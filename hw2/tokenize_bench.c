@@ -0,0 +1,89 @@
+/**
+ * Lines per second through the shell's read loop, on a large generated
+ * script, with the old getline + strtok + realloc loop as a baseline. No
+ * command is run. Build it with:
+ *
+ *     gcc -O2 tokenize_bench.c tokenize.c -o tokenize_bench
+ *     ./tokenize_bench [lines]
+ * */
+#define _GNU_SOURCE
+#include "tokenize.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * The loop shell.c used to have: a fresh line from getline, and a realloc of
+ * the arglist, for every line.
+ * */
+long baseline_words(FILE *script) {
+    long words = 0;
+    for (;;) {
+        char *line = NULL;
+        size_t size;
+        int count = 0;
+        if (getline(&line, &size, script) == -1) {
+            free(line);
+            break;
+        }
+        char **arglist = malloc(sizeof(char *));
+        arglist[0] = strtok(line, " \t\n");
+        while (arglist[count] != NULL) {
+            ++count;
+            arglist = realloc(arglist, sizeof(char *) * (count + 1));
+            arglist[count] = strtok(NULL, " \t\n");
+        }
+        words += count;
+        free(line);
+        free(arglist);
+    }
+    return words;
+}
+
+long reader_words(FILE *script) {
+    struct reader reader = {0};
+    char **arglist;
+    long words = 0;
+    int count;
+    while ((count = read_arglist(&reader, script, &arglist)) != -1) {
+        words += count;
+    }
+    reader_free(&reader);
+    return words;
+}
+
+void run(const char *name, long (*read_words)(FILE *), FILE *script,
+         long lines) {
+    rewind(script);
+    double start = now_seconds();
+    long words = read_words(script);
+    double seconds = now_seconds() - start;
+    printf("%-8s %10.0f lines/s (%ld words)\n", name, lines / seconds, words);
+}
+
+int main(int argc, char *argv[]) {
+    long lines = argc > 1 ? atol(argv[1]) : 1000000;
+    FILE *script = tmpfile();
+    if (!script) {
+        perror("tokenize_bench");
+        return 1;
+    }
+    // Build-driver style commands: short flags, long paths, a pipe
+    for (long i = 0; i < lines; i++) {
+        fprintf(script,
+                "gcc -O2 -Wall -c src/module_%ld/implementation_file.c -o "
+                "build/objects/module_%ld.o | tee logs/build_%ld.log\n",
+                i % 97, i, i % 13);
+    }
+    run("strtok", baseline_words, script, lines);
+    run("reader", reader_words, script, lines);
+    fclose(script);
+    return 0;
+}
@@ -0,0 +1,112 @@
+/**
+ * Benchmarks a message slot. First, operations per second against how many
+ * channels the slot has: each operation sets the channel with ioctl, writes
+ * a message to it and reads it back, the way message_sender and
+ * message_reader do, going round all the channels in turn. Then, the
+ * throughput of write / read pairs on one channel, against message size, up
+ * to the longest message the module takes (its `buf_length` parameter).
+ * Needs a slot device, e.g. made with `mknod /dev/slot0 c 235 0`:
+ *
+ *     gcc -O2 message_bench.c -o message_bench
+ *     ./message_bench /dev/slot0 [operations]
+ * */
+#include "message_slot.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_CHANNELS 65536
+#define MAX_MESSAGE_LENGTH (16 << 20)
+
+void check(int value) {
+    if (value < 0) {
+        perror("message_bench");
+        exit(1);
+    }
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void bench_channels(int slot_fd, int operations) {
+    char message[] = "message";
+    char buffer[128];
+    printf("%8s %12s\n", "channels", "ops/s");
+    for (int channels = 1; channels <= MAX_CHANNELS; channels *= 16) {
+        // Create the channels first, so only looking them up is timed
+        for (int id = 1; id <= channels; id++) {
+            check(ioctl(slot_fd, MSG_SLOT_CHANNEL, id));
+            check(write(slot_fd, message, sizeof(message)));
+        }
+        double start = now_seconds();
+        for (int i = 0; i < operations; i++) {
+            check(ioctl(slot_fd, MSG_SLOT_CHANNEL, i % channels + 1));
+            check(write(slot_fd, message, sizeof(message)));
+            check(read(slot_fd, buffer, sizeof(buffer)));
+        }
+        printf("%8d %12.0f\n", channels,
+               operations / (now_seconds() - start));
+    }
+}
+
+void bench_sizes(int slot_fd, int operations) {
+    char *message = calloc(1, MAX_MESSAGE_LENGTH);
+    char *buffer = malloc(MAX_MESSAGE_LENGTH);
+    if (!message || !buffer) {
+        check(-1);
+    }
+    check(ioctl(slot_fd, MSG_SLOT_CHANNEL, MAX_CHANNELS + 1));
+    printf("%10s %12s %12s\n", "bytes", "pairs/s", "MiB/s");
+    int too_long = 0;
+    for (int length = 1; length <= MAX_MESSAGE_LENGTH && !too_long;
+         length *= 4) {
+        // Fewer pairs of the larger messages, so each size takes about as
+        // long
+        int pairs = length > 1024 ? operations / (length / 1024) : operations;
+        if (pairs < 100) {
+            pairs = 100;
+        }
+        double start = now_seconds();
+        for (int i = 0; i < pairs && !too_long; i++) {
+            if (write(slot_fd, message, length) < 0) {
+                // Longer than the module's `buf_length` is the end
+                if (errno != EMSGSIZE) {
+                    check(-1);
+                }
+                too_long = 1;
+                break;
+            }
+            check(read(slot_fd, buffer, length));
+        }
+        double seconds = now_seconds() - start;
+        if (!too_long) {
+            printf("%10d %12.0f %12.1f\n", length, pairs / seconds,
+                   2.0 * pairs * length / seconds / (1 << 20));
+        }
+    }
+    free(message);
+    free(buffer);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc != 2 && argc != 3) {
+        fprintf(stderr, "message_bench: unexpected number of arguments\n");
+        return 1;
+    }
+    int operations = argc > 2 ? atoi(argv[2]) : 1000000;
+    int slot_fd = open(argv[1], O_RDWR);
+    check(slot_fd);
+    bench_channels(slot_fd, operations);
+    bench_sizes(slot_fd, operations);
+    check(close(slot_fd));
+    return 0;
+}
@@ -7,161 +7,226 @@
 #include <linux/init.h>
 #include <linux/kernel.h> /* We're doing kernel work */
 #include <linux/module.h> /* Specifically, a module */
+#include <linux/mm.h> /* for kvmalloc */
+#include <linux/moduleparam.h>
+#include <linux/mutex.h>
+#include <linux/seqlock.h>
 #include <linux/slab.h>
 #include <linux/string.h>  /* for memset. NOTE - not string.h!*/
-#include <linux/uaccess.h> /* for get_user and put_user */
+#include <linux/uaccess.h> /* for copy_from_user and copy_to_user */
+#include <linux/xarray.h>
 
 #include "message_slot.h"
 
 #define MAX_MESSAGE_SLOTS 256
-#define CHANNEL_BUF_LENGTH 128
+#define MAX_BUF_LENGTH (16 << 20)
 #define MAJOR_NUM 235
 #define DEVICE_NAME "message_slot"
 
 MODULE_LICENSE("GPL");
 
+// The longest message a channel holds
+static unsigned int buf_length = 128;
+module_param(buf_length, uint, 0444);
+MODULE_PARM_DESC(buf_length, "Longest message a channel holds, in bytes");
+
+struct message_t {
+    size_t length;
+    char data[];
+};
+
+/**
+ * A channel holds two message buffers. `latest` has the last message
+ * written, and the next write goes into `spare`, which is swapped in once
+ * the whole message is there. A write that fails partway leaves the current
+ * message as it was. Both buffers are only allocated by the first write, so
+ * selecting a channel costs no more than the channel itself.
+ *
+ * Writers take turns under `lock`, and swap the buffers inside a `seq` write
+ * section. Readers don't lock at all: a reader copying out a buffer that a
+ * writer turned into the spare and started overwriting sees `seq` change,
+ * and copies the new latest message instead. Writers only hold up readers
+ * for the swap, not for the copy.
+ * */
 struct channel_t {
-    unsigned int id;
-    char buf[CHANNEL_BUF_LENGTH];
-    unsigned char message_length;
-    struct channel_t *next;
+    unsigned long id;
+    struct message_t *latest; // NULL until the first write
+    struct message_t *spare;
+    struct mutex lock;
+    seqcount_mutex_t seq;
 };
 
 struct message_slot_t {
-    struct channel_t *channels;
+    // The channels used so far, indexed by id. Looking one up takes no lock,
+    // `lock` is only held to add one.
+    struct xarray channels;
+    struct mutex lock;
 };
 
 struct message_slot_t message_slots[MAX_MESSAGE_SLOTS];
 
+/**
+ * Allocates an empty message buffer. kvmalloc falls back to vmalloc for
+ * buffers too large to be contiguous.
+ * */
+struct message_t *new_message(void) {
+    struct message_t *message =
+        kvmalloc(sizeof(struct message_t) + buf_length, GFP_KERNEL);
+    if (message)
+        message->length = 0;
+    return message;
+}
+
+void free_channel(struct channel_t *channel) {
+    kvfree(channel->latest);
+    kvfree(channel->spare);
+    kfree(channel);
+}
+
 struct channel_t *new_channel(unsigned long id) {
     struct channel_t *new_channel =
         kmalloc(sizeof(struct channel_t), GFP_KERNEL);
     if (!new_channel)
         return new_channel;
     new_channel->id = id;
-    memset(new_channel->buf, 0, CHANNEL_BUF_LENGTH);
-    new_channel->next = NULL;
-    new_channel->message_length = 0;
+    new_channel->latest = NULL;
+    new_channel->spare = NULL;
+    mutex_init(&new_channel->lock);
+    seqcount_mutex_init(&new_channel->seq, &new_channel->lock);
     return new_channel;
 }
 
 /**
- * Searches the linked list of channels of the slot with the given minor number,
- * for a channel with the given id. Returns a pointer to that channel, creating
- * it if it doesn't exist, and `create != 0`. Returns NULL if there was an
- * error, or if `create = 0` and the channel wasn't found.
+ * Looks up the channel with the given id in the slot with the given minor
+ * number. Returns a pointer to that channel, creating it if it doesn't exist.
+ * Returns NULL if there was an error.
+ *
+ * The slot's channels are in an xarray keyed by id, so a lookup costs the same
+ * however many channels the slot has.
  * */
-struct channel_t *find_channel(unsigned long id, unsigned int minor_num,
-                               int create) {
-    struct channel_t *channel = message_slots[minor_num].channels;
-    while (channel && channel->id != id && channel->next) {
-        channel = channel->next;
+struct channel_t *find_channel(unsigned long id, unsigned int minor_num) {
+    struct message_slot_t *slot = &message_slots[minor_num];
+    struct channel_t *channel = xa_load(&slot->channels, id);
+    if (channel) {
+        return channel;
     }
+    mutex_lock(&slot->lock);
+    // Another file may have created it while we waited for the lock
+    channel = xa_load(&slot->channels, id);
     if (!channel) {
-        if (!create) {
-            return NULL;
-        }
-        // No channels written to yet
-        message_slots[minor_num].channels = new_channel(id);
-        channel = message_slots[minor_num].channels;
-    } else if (channel->id != id) {
-        if (!create) {
-            return NULL;
+        // Not used yet
+        channel = new_channel(id);
+        if (channel &&
+            xa_err(xa_store(&slot->channels, id, channel, GFP_KERNEL))) {
+            free_channel(channel);
+            channel = NULL;
         }
-        // No writes to this channel yet
-        // At end of list
-        channel->next = new_channel(id);
-        channel = channel->next;
     }
+    mutex_unlock(&slot->lock);
     return channel;
 }
 
-static int copy_user_buffer(const char *user_buffer, char *kernel_buffer,
-                            size_t length) {
-    int i, success;
-    for (i = 0; i < length; i++) {
-        success = get_user(kernel_buffer[i], &user_buffer[i]);
-        if (success < 0) {
-            return success;
-        }
-    }
-    return 0;
-}
-
-static int put_user_buffer(char *user_buffer, char *kernel_buffer,
-                           size_t length) {
-    int i, success;
-    for (i = 0; i < length; i++) {
-        success = put_user(kernel_buffer[i], &user_buffer[i]);
-        if (success < 0) {
-            return success;
-        }
-    }
-    return 0;
-}
-
 static ssize_t device_write(struct file *file, const char __user *buffer,
                             size_t length, loff_t *offset) {
-    char intermediate_buffer[CHANNEL_BUF_LENGTH];
-    struct channel_t *channel;
-    unsigned int minor_num = iminor(file->f_inode);
-    unsigned long id = (unsigned long)file->private_data;
-    if (id == 0) {
+    struct channel_t *channel = file->private_data;
+    struct message_t *message;
+    if (!channel) {
         return -EINVAL;
     }
-    if (length == 0 || length > CHANNEL_BUF_LENGTH) {
+    if (length == 0 || length > buf_length) {
         return -EMSGSIZE;
     }
-    channel = find_channel(id, minor_num, 1);
-    if (!channel) {
-        // Probably problem with memory allocation
-        return -ENOMEM;
+    if (mutex_lock_interruptible(&channel->lock)) {
+        return -ERESTARTSYS;
+    }
+    if (!channel->spare) {
+        // The first write allocates both buffers, with an empty one as the
+        // latest message until this one is in
+        struct message_t *spare = new_message();
+        struct message_t *latest = new_message();
+        if (!spare || !latest) {
+            kvfree(spare);
+            kvfree(latest);
+            mutex_unlock(&channel->lock);
+            return -ENOMEM;
+        }
+        channel->spare = spare;
+        smp_store_release(&channel->latest, latest);
     }
-    if (copy_user_buffer(buffer, intermediate_buffer, length) < 0) {
+    // Copied straight into the spare buffer, in one go. Readers still
+    // copying out this buffer will retry, since `seq` changed when it
+    // stopped being the latest.
+    message = channel->spare;
+    if (copy_from_user(message->data, buffer, length)) {
+        mutex_unlock(&channel->lock);
         return -EFAULT;
     }
-    memcpy(channel->buf, intermediate_buffer, length);
-    channel->message_length = length;
+    message->length = length;
+    // Publish the message only once it's complete
+    write_seqcount_begin(&channel->seq);
+    channel->spare = channel->latest;
+    WRITE_ONCE(channel->latest, message);
+    write_seqcount_end(&channel->seq);
+    mutex_unlock(&channel->lock);
     return length;
 }
 
+/**
+ * Sets the file's channel, creating it if needed. The channel is kept in the
+ * file's `private_data`, so reads and writes don't look it up again. Channels
+ * are only freed when the module is unloaded, which can't happen while a file
+ * is open.
+ * */
 static long device_ioctl(struct file *file, unsigned int ioctl_command_id,
                          unsigned long ioctl_param) {
+    struct channel_t *channel;
     if (ioctl_command_id != MSG_SLOT_CHANNEL || ioctl_param == 0) {
         return -EINVAL;
     }
 
-    file->private_data = (void *)ioctl_param;
+    channel = find_channel(ioctl_param, iminor(file->f_inode));
+    if (!channel) {
+        // Probably problem with memory allocation
+        return -ENOMEM;
+    }
+    file->private_data = channel;
     return 0;
 }
 
 static int device_open(struct inode *inode, struct file *file) {
-    file->private_data = (void *)0;
+    file->private_data = NULL;
     return 0;
 }
 
 static ssize_t device_read(struct file *file, char __user *buffer,
                            size_t length, loff_t *offset) {
-    struct channel_t *channel;
-    int success;
-    unsigned int minor_num = iminor(file->f_inode);
-    unsigned long id = (unsigned long)file->private_data;
-    if (id == 0) {
-        return -EINVAL;
-    }
-    channel = find_channel(id, minor_num, 0);
+    struct channel_t *channel = file->private_data;
+    struct message_t *message;
+    unsigned int seq;
+    size_t message_length;
+    ssize_t result;
     if (!channel) {
-        // No channel - means no writes to it yet
-        return -EWOULDBLOCK;
-    }
-    if (length < channel->message_length) {
-        return -ENOSPC;
-    }
-    success = put_user_buffer(buffer, channel->buf, channel->message_length);
-    if (success < 0) {
-        return -EFAULT;
+        return -EINVAL;
     }
-    return channel->message_length;
+    // Copy the latest message out without locking, again if a write
+    // published a new one meanwhile. What a torn copy left in `buffer` is
+    // overwritten by the retry.
+    do {
+        seq = read_seqcount_begin(&channel->seq);
+        message = READ_ONCE(channel->latest);
+        message_length = message ? READ_ONCE(message->length) : 0;
+        if (message_length == 0) {
+            // No writes to it yet
+            result = -EWOULDBLOCK;
+        } else if (length < message_length) {
+            result = -ENOSPC;
+        } else if (copy_to_user(buffer, message->data, message_length)) {
+            result = -EFAULT;
+        } else {
+            result = message_length;
+        }
+    } while (read_seqcount_retry(&channel->seq, seq));
+    return result;
 }
 
 struct file_operations fops = {
@@ -174,29 +239,36 @@ struct file_operations fops = {
 
 static int __init message_slot_module_init(void) {
     int i;
-    int register_return = register_chrdev(MAJOR_NUM, DEVICE_NAME, &fops);
+    int register_return;
+    if (buf_length == 0 || buf_length > MAX_BUF_LENGTH) {
+        printk(KERN_ERR "%s buf_length must be between 1 and %d", DEVICE_NAME,
+               MAX_BUF_LENGTH);
+        return -EINVAL;
+    }
+    // The device can be opened as soon as it's registered
+    for (i = 0; i < MAX_MESSAGE_SLOTS; i++) {
+        xa_init(&message_slots[i].channels);
+        mutex_init(&message_slots[i].lock);
+    }
+    register_return = register_chrdev(MAJOR_NUM, DEVICE_NAME, &fops);
     if (register_return < 0) {
         printk(KERN_ERR "%s registration failed for %d, with return value %d",
                DEVICE_NAME, MAJOR_NUM, register_return);
         return register_return;
     }
 
-    for (i = 0; i < MAX_MESSAGE_SLOTS; i++) {
-        message_slots[i].channels = NULL;
-    }
     printk(KERN_INFO "%s registration successful for major number %d",
            DEVICE_NAME, MAJOR_NUM);
     return 0;
 }
 
 void cleanup_message_slot(struct message_slot_t *slot) {
-    struct channel_t *next;
-    struct channel_t *channel = slot->channels;
-    while (channel) {
-        next = channel->next;
-        kfree(channel);
-        channel = next;
+    struct channel_t *channel;
+    unsigned long id;
+    xa_for_each(&slot->channels, id, channel) {
+        free_channel(channel);
     }
+    xa_destroy(&slot->channels);
 }
 
 static void __exit message_slot_module_exit(void) {
@@ -0,0 +1,229 @@
+/**
+ * Stress test and throughput benchmark for concurrent access to a message
+ * slot. Runs writer and reader processes in equal numbers, 1 of each up to
+ * one of each per core, all hammering the same few channels. Writers write
+ * messages of random lengths whose every byte is derived from a header at
+ * their start, and readers check each message they read against its header,
+ * so a torn message (half of one write, half of another) is caught. Prints
+ * the writes and reads per second at each number of processes, and exits
+ * with 1 if any message was torn. Needs a slot device, e.g. made with
+ * `mknod /dev/slot0 c 235 0`:
+ *
+ *     gcc -O2 message_stress.c -o message_stress
+ *     ./message_stress /dev/slot0 [seconds per step] [channels]
+ * */
+#include "message_slot.h"
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// The module's default `buf_length`
+#define MAX_MESSAGE_LENGTH 128
+
+struct header {
+    uint32_t channel;
+    uint32_t length;
+    uint64_t serial;
+};
+
+/**
+ * What each process did, in a mapping shared with the parent.
+ * */
+struct counts {
+    long operations;
+    long torn;
+};
+
+/**
+ * Set in forked writers and readers, which must leave with `_exit` so they
+ * don't flush stdio buffers they share with the parent.
+ * */
+int in_child = 0;
+
+void check(int value) {
+    if (value < 0) {
+        perror("message_stress");
+        if (in_child) {
+            _exit(1);
+        }
+        exit(1);
+    }
+}
+
+double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+char pattern_byte(const struct header *header, int i) {
+    return (char)(header->serial * 31 + i);
+}
+
+void fill_message(char *message, uint32_t channel, uint32_t length,
+                  uint64_t serial) {
+    struct header header = {channel, length, serial};
+    memcpy(message, &header, sizeof(header));
+    for (uint32_t i = sizeof(header); i < length; i++) {
+        message[i] = pattern_byte(&header, i);
+    }
+}
+
+/**
+ * Whether `message`, `length` bytes read from `channel`, is one whole write.
+ * */
+int message_intact(const char *message, int length, uint32_t channel) {
+    struct header header;
+    if (length < (int)sizeof(header)) {
+        return 0;
+    }
+    memcpy(&header, message, sizeof(header));
+    if (header.channel != channel || header.length != (uint32_t)length) {
+        return 0;
+    }
+    for (int i = sizeof(header); i < length; i++) {
+        if (message[i] != pattern_byte(&header, i)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void run_writer(const char *path, int channels, double deadline, int seed,
+                struct counts *counts) {
+    int slot_fd = open(path, O_WRONLY);
+    check(slot_fd);
+    char message[MAX_MESSAGE_LENGTH];
+    unsigned int random_state = seed;
+    for (uint64_t serial = 0; now_seconds() < deadline; serial++) {
+        // A few hundred writes between checking the time
+        for (int i = 0; i < 256; i++) {
+            uint32_t channel = rand_r(&random_state) % channels + 1;
+            uint32_t length = sizeof(struct header) +
+                              rand_r(&random_state) %
+                                  (MAX_MESSAGE_LENGTH -
+                                   sizeof(struct header) + 1);
+            fill_message(message, channel, length, serial * 256 + i);
+            check(ioctl(slot_fd, MSG_SLOT_CHANNEL, channel));
+            check(write(slot_fd, message, length));
+            counts->operations++;
+        }
+    }
+    check(close(slot_fd));
+}
+
+void run_reader(const char *path, int channels, double deadline, int seed,
+                struct counts *counts) {
+    int slot_fd = open(path, O_RDONLY);
+    check(slot_fd);
+    char message[MAX_MESSAGE_LENGTH];
+    unsigned int random_state = seed;
+    while (now_seconds() < deadline) {
+        for (int i = 0; i < 256; i++) {
+            uint32_t channel = rand_r(&random_state) % channels + 1;
+            check(ioctl(slot_fd, MSG_SLOT_CHANNEL, channel));
+            int length = read(slot_fd, message, sizeof(message));
+            check(length);
+            if (!message_intact(message, length, channel)) {
+                counts->torn++;
+            }
+            counts->operations++;
+        }
+    }
+    check(close(slot_fd));
+}
+
+/**
+ * Runs `pairs` writers and `pairs` readers for `seconds`, and prints their
+ * throughput. Returns the number of torn messages the readers saw.
+ * */
+long run_step(const char *path, int pairs, int channels, double seconds) {
+    struct counts *counts =
+        mmap(NULL, 2 * pairs * sizeof(struct counts), PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counts == MAP_FAILED) {
+        check(-1);
+    }
+    double deadline = now_seconds() + seconds;
+    // Children would otherwise inherit and re-print the buffered rows.
+    fflush(stdout);
+    for (int i = 0; i < 2 * pairs; i++) {
+        pid_t child = fork();
+        check(child);
+        if (child == 0) {
+            in_child = 1;
+            if (i < pairs) {
+                run_writer(path, channels, deadline, i + 1, &counts[i]);
+            } else {
+                run_reader(path, channels, deadline, i + 1, &counts[i]);
+            }
+            _exit(0);
+        }
+    }
+    int failed = 0;
+    int status;
+    while (wait(&status) > 0) {
+        failed |= !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+    }
+    if (failed) {
+        fprintf(stderr, "message_stress: a process failed\n");
+        exit(1);
+    }
+
+    long writes = 0, reads = 0, torn = 0;
+    for (int i = 0; i < 2 * pairs; i++) {
+        if (i < pairs) {
+            writes += counts[i].operations;
+        } else {
+            reads += counts[i].operations;
+        }
+        torn += counts[i].torn;
+    }
+    printf("%7d %7d %14.0f %14.0f %7ld\n", pairs, pairs, writes / seconds,
+           reads / seconds, torn);
+    munmap(counts, 2 * pairs * sizeof(struct counts));
+    return torn;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2 || argc > 4) {
+        fprintf(stderr, "message_stress: unexpected number of arguments\n");
+        return 1;
+    }
+    double seconds = argc > 2 ? atof(argv[2]) : 2;
+    int channels = argc > 3 ? atoi(argv[3]) : 4;
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+
+    // Every channel has a message before the readers start
+    int slot_fd = open(argv[1], O_WRONLY);
+    check(slot_fd);
+    char message[MAX_MESSAGE_LENGTH];
+    for (int channel = 1; channel <= channels; channel++) {
+        fill_message(message, channel, sizeof(struct header), 0);
+        check(ioctl(slot_fd, MSG_SLOT_CHANNEL, channel));
+        check(write(slot_fd, message, sizeof(struct header)));
+    }
+    check(close(slot_fd));
+
+    long torn = 0;
+    printf("%7s %7s %14s %14s %7s\n", "writers", "readers", "writes/s",
+           "reads/s", "torn");
+    // Doubling each step, and ending on one pair per core even when the
+    // number of cores isn't a power of 2
+    for (int pairs = 1;; pairs = pairs * 2 < cores ? pairs * 2 : cores) {
+        torn += run_step(argv[1], pairs, channels, seconds);
+        if (pairs >= cores) {
+            break;
+        }
+    }
+    return torn ? 1 : 0;
+}